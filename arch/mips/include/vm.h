@@ -31,6 +31,7 @@
 #define _MIPS_VM_H_
 
 #include <types.h>
+#include <spinlock.h>
 
 /*
  * Machine-dependent VM system definitions.
@@ -138,7 +139,10 @@ struct pt_entry {
 /*
  * TLB shootdown bits.
  *
- * We'll take up to 16 invalidations before just flushing the whole TLB.
+ * A shootdown lives on the initiator's stack and is copied into each
+ * target cpu's IPI ring. ts_pending points back at the initiator's
+ * count of cpus yet to finish, which each target decrements and the
+ * initiator waits on.
  */
 
 // TLB shootdown types
@@ -149,14 +153,15 @@ struct tlbshootdown {
     int                 ts_type;
 	vaddr_t             ts_vaddr;
 	struct pt_entry    *ts_pte;
-    struct semaphore   *ts_sem;
+    volatile spinlock_data_t *ts_pending;
 };
 
-struct tlbshootdown *ts_create(int type, vaddr_t vaddr, struct pt_entry *pte);
-void ts_return(struct tlbshootdown *ts);
+void ts_init(struct tlbshootdown *ts, int type, vaddr_t vaddr,
+             struct pt_entry *pte, volatile spinlock_data_t *pending);
+void ts_expect(const struct tlbshootdown *ts, unsigned ncpus);
+void ts_unexpect(const struct tlbshootdown *ts, unsigned ncpus);
 void ts_wait(const struct tlbshootdown *ts);
 void ts_finish(const struct tlbshootdown *ts);
-void ts_bootstrap(void);
 
 #define TLBSHOOTDOWN_MAX 16
 
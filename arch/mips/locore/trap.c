@@ -207,6 +207,15 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+
+		/*
+		 * A thread busy in user mode has to notice its process
+		 * exiting somewhere, and a timer interrupt always comes.
+		 */
+		if (!iskern && curthread->t_proc != NULL &&
+		    curthread->t_proc->ps_exiting) {
+			process_thread_leave();
+		}
 		goto done2;
 	}
 
@@ -327,6 +336,15 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	/*
+	 * On the way back to user mode, leave if another thread is
+	 * taking the process down (see process_finish).
+	 */
+	if (!iskern && curthread->t_proc != NULL &&
+	    curthread->t_proc->ps_exiting) {
+		process_thread_leave();
+	}
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -375,6 +393,7 @@ mips_trap(struct trapframe *tf)
  * following places:
  *    - enter_new_process, for use by exec and equivalent.
  *    - enter_forked_process, in syscall.c, for use by fork.
+ *    - enter_new_thread, for use by thread_create.
  */
 void
 mips_usermode(struct trapframe *tf)
@@ -442,3 +461,25 @@ enter_new_process(int argc, userptr_t argv, vaddr_t stack, vaddr_t entry)
 
 	mips_usermode(&tf);
 }
+
+/*
+ * enter_new_thread: go to user mode in a new thread of a process.
+ *
+ * Like enter_new_process, but the thread function gets the one
+ * argument ARG. The return address is zero, so a thread function
+ * that returns instead of calling thread_exit faults.
+ */
+void
+enter_new_thread(vaddr_t arg, vaddr_t stack, vaddr_t entry)
+{
+	struct trapframe tf;
+
+	bzero(&tf, sizeof(tf));
+
+	tf.tf_status = CST_IRQMASK | CST_IEp | CST_KUp;
+	tf.tf_epc = entry;
+	tf.tf_a0 = arg;
+	tf.tf_sp = stack;
+
+	mips_usermode(&tf);
+}
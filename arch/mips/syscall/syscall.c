@@ -152,6 +152,10 @@ syscall(struct trapframe *tf)
             err = sys___time((userptr_t)tf->tf_a0,
                              (userptr_t)tf->tf_a1);
             break;
+	    case SYS_nanosleep:
+            err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+                                (userptr_t)tf->tf_a1);
+            break;
         case SYS_fork:
             retval = sys_fork(tf, &err);
             break;
@@ -220,6 +224,29 @@ syscall(struct trapframe *tf)
         case SYS_vmstat:
             err = sys_vmstat((userptr_t)tf->tf_a0);
             break;
+        case SYS_memstat:
+            err = sys_memstat((userptr_t)tf->tf_a0);
+            break;
+        case SYS_rsslimit:
+            err = sys_rsslimit((size_t)tf->tf_a0);
+            break;
+        case SYS_setaffinity:
+            err = sys_setaffinity((uint32_t)tf->tf_a0);
+            break;
+        case SYS_thread_create:
+            retval = sys_thread_create((userptr_t)tf->tf_a0,
+                                       (userptr_t)tf->tf_a1, &err);
+            break;
+        case SYS_thread_join:
+            err = sys_thread_join((int)tf->tf_a0, (userptr_t)tf->tf_a1);
+            break;
+        case SYS_thread_exit:
+            err = sys_thread_exit((int)tf->tf_a0);
+            break;
+        case SYS_futex:
+            retval = sys_futex((userptr_t)tf->tf_a0, (int)tf->tf_a1,
+                               (int)tf->tf_a2, &err);
+            break;
 	    default:
             kprintf("Unknown syscall %d\n", callno);
             err = ENOSYS;
@@ -266,9 +293,9 @@ syscall(struct trapframe *tf)
  * Receives a trapframe from fork() identical to that
  * of the parent process.  This trapframe contains, in
  * its tf_v0 (TF_RET) field, a pointer to the child's
- * process struct.  This function is responsible for
- * setting curthread->t_proc and curthread->t_proc->ps_thread
- * properly.
+ * process struct, and in TID the thread ID reserved for
+ * it.  This function is responsible for attaching the
+ * thread to the process (process_thread_attach).
  *
  * The trapframe argument is kernel-heap-allocated.  So
  * before entering user mode, we have to copy it onto
@@ -281,11 +308,8 @@ syscall(struct trapframe *tf)
  * this is done for the parent in syscall() above).
  */
 void
-enter_forked_process(void *child_tf, unsigned long trash)
+enter_forked_process(void *child_tf, unsigned long tid)
 {
-
-    (void) trash; 
-    
 	struct trapframe *my_tf = (struct trapframe *)child_tf;
     
     struct trapframe stack_tf;
@@ -294,8 +318,7 @@ enter_forked_process(void *child_tf, unsigned long trash)
     
     // associate process and thread
     struct process *me = (struct process *)stack_tf.tf_v0;
-    curthread->t_proc = me;
-    me->ps_thread = curthread;
+    process_thread_attach(me, (int)tid);
     
     // activate address space
     as_activate(me->ps_addrspace);
@@ -105,6 +105,28 @@ cpu_identify(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Cycle counter.
+ *
+ * System/161 implements the MIPS-II coprocessor 0 count register,
+ * which increments once per processor cycle and wraps around.
+ */
+uint32_t
+cpu_cycles(void)
+{
+	uint32_t x;
+
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		"mfc0 %0,$9;"		/* x = c0_count */
+		".set pop"		/* restore assembler mode */
+		: "=r" (x));
+	return x;
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Interrupt control.
  *
@@ -86,6 +86,14 @@ alloc_kpages(int npages)
 	return PADDR_TO_KVADDR(pa);
 }
 
+/* All dumbvm pages are direct-mapped, so they are always eager. */
+vaddr_t
+alloc_kpages_flags(int npages, int flags)
+{
+	(void)flags;
+	return alloc_kpages(npages);
+}
+
 void
 free_kpages(vaddr_t addr)
 {
@@ -335,6 +343,16 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_define_threadstack(struct addrspace *as, int n, vaddr_t *stackptr)
+{
+	/* dumbvm has room for just the one stack */
+	(void)as;
+	(void)n;
+	(void)stackptr;
+	return EUNIMP;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -36,10 +36,17 @@
 #include <spinlock.h>
 #include <coremem.h>
 #include <vmstat.h>
+#include <vm.h>
 #include <kvm.h>
 
 #define KHEAP_MAXPAGES 1024
 
+// Frames acquired per batch when populating an eager allocation
+#define KVM_BATCH 16
+// Most entries an eager allocation may preload into the TLB,
+// so that a large allocation does not flush the user's mappings
+#define KVM_PRELOAD_MAX (NUM_TLB / 4)
+
 struct kvm_pte {
     unsigned kte_frame:20;      // physical page number
     unsigned kte_reserved:10;   // unused for now
@@ -54,8 +61,40 @@ static struct kvm_pte   kvm_pt[KHEAP_MAXPAGES];
 static struct spinlock  kvm_lock = SPINLOCK_INITIALIZER;
 static int              kvm_index = 0; // search index
 
+// Back every page of a freshly allocated extent with a frame
+// and preload the first few mappings into this CPU's TLB.
+// Returns ENOMEM if physical memory runs out part way; the
+// caller frees the extent, which releases any frames taken.
+static
+int
+kvm_populate(int start, int npages)
+{
+    paddr_t frames[KVM_BATCH];
+    
+    for (int i = 0; i < npages; i += KVM_BATCH) {
+        unsigned want = (npages - i < KVM_BATCH) ? npages - i : KVM_BATCH;
+        unsigned got = core_acquire_frames(frames, want);
+        
+        for (unsigned j = 0; j < got; j++) {
+            int index = start + i + j;
+            vaddr_t vaddr = index * PAGE_SIZE + MIPS_KSEG2;
+            
+            kvm_pt[index].kte_frame = PAGE_NUM(frames[j]);
+            core_reserve_frame(frames[j]);
+            core_release_frame(frames[j]);
+            
+            if (i + j < KVM_PRELOAD_MAX)
+                tlb_load(vaddr, frames[j], true, true);
+        }
+        
+        if (got < want)
+            return ENOMEM;
+    }
+    return 0;
+}
+
 vaddr_t
-kvm_alloc_contig(int npages)
+kvm_alloc_contig(int npages, int flags)
 {
     spinlock_acquire(&kvm_lock);
     
@@ -99,8 +138,17 @@ kvm_alloc_contig(int npages)
     
     spinlock_release(&kvm_lock);
     
+    vaddr_t vaddr = start * PAGE_SIZE + MIPS_KSEG2;
+    
+    // back the pages now if asked, rather than in kvm_fault()
+    // (the extent is marked used, so nobody else can touch it)
+    if ((flags & KALLOC_EAGER) && kvm_populate(start, npages)) {
+        kvm_free_contig(vaddr);
+        return 0;
+    }
+    
     // return the block
-    return start * PAGE_SIZE + MIPS_KSEG2;
+    return vaddr;
 }
 
 void
@@ -45,10 +45,12 @@
 #define L1_INDEX(va) (PAGE_NUM(va) >> 10) // index into the level 1 table
 #define L2_INDEX(va) (PAGE_NUM(va) & (LEVEL_SIZE - 1)) // index into the level 2 table
 
-static void pte_destroy(struct pt_entry *pte);
+static void pte_destroy(struct pt_entry *pte, struct addrspace *owner);
 static bool pte_incr_ref(struct pt_entry *pte);
-static struct pt_entry *pte_copy(vaddr_t vaddr, struct pt_entry *old_pte);
-static struct pt_entry *pte_copy_deep(vaddr_t vaddr, struct pt_entry *old_pte);
+static struct pt_entry *pte_copy(vaddr_t vaddr, struct pt_entry *old_pte,
+                                 struct addrspace *owner);
+static struct pt_entry *pte_copy_deep(vaddr_t vaddr, struct pt_entry *old_pte,
+                                      struct addrspace *owner);
 
 struct page_table
 {
@@ -69,24 +71,47 @@ pt_create(void)
 }
 
 void
-pt_destroy(struct page_table *pt)
+pt_destroy(struct page_table *pt, struct addrspace *owner)
 {
-    for (int i = 0; i < LEVEL_SIZE; i++) {
-        if (pt->pt_index[i] != NULL) {
-            for (int j = 0; j < LEVEL_SIZE; j++) {
-                if (pt->pt_index[i][j] != NULL) {
-                    pt_acquire_entry(pt, INDEX_TO_VADDR(i, j));
-                    pte_destroy(pt->pt_index[i][j]);
-                }
-            }
+    unsigned pos = 0;
+    pt_destroy_some(pt, &pos, (unsigned)-1, owner);
+}
+
+bool
+pt_destroy_some(struct page_table *pt, unsigned *pos, unsigned budget,
+                struct addrspace *owner)
+{
+    while (*pos < LEVEL_SIZE * LEVEL_SIZE) {
+        unsigned i = *pos / LEVEL_SIZE;
+        unsigned j = *pos % LEVEL_SIZE;
+        
+        // skip unpopulated second level tables whole
+        if (pt->pt_index[i] == NULL) {
+            *pos = (i + 1) * LEVEL_SIZE;
+            continue;
+        }
+        
+        if (pt->pt_index[i][j] != NULL) {
+            if (budget == 0)
+                return false;
+            budget--;
+            pt_acquire_entry(pt, INDEX_TO_VADDR(i, j));
+            pte_destroy(pt->pt_index[i][j], owner);
+            pt->pt_index[i][j] = NULL;
+        }
+        
+        (*pos)++;
+        if (*pos % LEVEL_SIZE == 0) {
             kfree(pt->pt_index[i]);
+            pt->pt_index[i] = NULL;
         }
     }
     kfree(pt);
+    return true;
 }
 
 struct page_table *
-pt_copy_deep(struct page_table *old_pt)
+pt_copy_deep(struct page_table *old_pt, struct addrspace *owner)
 {
     struct page_table *new_pt = pt_create();
     if (new_pt == NULL)
@@ -99,7 +124,7 @@ pt_copy_deep(struct page_table *old_pt)
         // Create second level page table
         new_pt->pt_index[i] = kmalloc(LEVEL_SIZE * sizeof(struct pt_entry *));
         if (new_pt->pt_index[i] == NULL) {
-            pt_destroy(new_pt);
+            pt_destroy(new_pt, owner);
             return NULL;
         }
         bzero(new_pt->pt_index[i], LEVEL_SIZE * sizeof(struct pt_entry *));
@@ -110,9 +135,10 @@ pt_copy_deep(struct page_table *old_pt)
             
             // Deeply copy every page table entry
             struct pt_entry *old_pte = pt_acquire_entry(old_pt, INDEX_TO_VADDR(i, j));
-            struct pt_entry *new_pte = pte_copy_deep(INDEX_TO_VADDR(i, j), old_pte);
+            struct pt_entry *new_pte = pte_copy_deep(INDEX_TO_VADDR(i, j), old_pte,
+                                                     owner);
             if (new_pte == NULL) {
-                pt_destroy(new_pt);
+                pt_destroy(new_pt, owner);
                 return NULL;
             }
             
@@ -126,7 +152,7 @@ pt_copy_deep(struct page_table *old_pt)
 }
 
 struct page_table *
-pt_copy_shallow(struct page_table *old_pt)
+pt_copy_shallow(struct page_table *old_pt, struct addrspace *owner)
 {
     struct page_table *new_pt = pt_create();
     if (new_pt == NULL)
@@ -139,7 +165,7 @@ pt_copy_shallow(struct page_table *old_pt)
         // Create second level page table
         new_pt->pt_index[i] = kmalloc(LEVEL_SIZE * sizeof(struct pt_entry *));
         if (new_pt->pt_index[i] == NULL) {
-            pt_destroy(new_pt);
+            pt_destroy(new_pt, owner);
             return NULL;
         }
         bzero(new_pt->pt_index[i], LEVEL_SIZE * sizeof(struct pt_entry *));
@@ -150,9 +176,9 @@ pt_copy_shallow(struct page_table *old_pt)
             
             // Shallowly copy every page table entry
             struct pt_entry *old_pte = pt_acquire_entry(old_pt, INDEX_TO_VADDR(i, j));
-            struct pt_entry *new_pte = pte_copy(INDEX_TO_VADDR(i, j), old_pte);
+            struct pt_entry *new_pte = pte_copy(INDEX_TO_VADDR(i, j), old_pte, owner);
             if (new_pte == NULL) {
-                pt_destroy(new_pt);
+                pt_destroy(new_pt, owner);
                 return NULL;
             }
             
@@ -169,7 +195,7 @@ pt_copy_shallow(struct page_table *old_pt)
 // Makes a deep copy of that PTE and returns it
 // Unlocks the old PTE; the new PTE is returned locked
 struct pt_entry *
-pt_copyonwrite(struct page_table* pt, vaddr_t vaddr)
+pt_copyonwrite(struct page_table* pt, vaddr_t vaddr, struct addrspace *owner)
 {
     unsigned long l1_idx = L1_INDEX(vaddr);
     unsigned long l2_idx = L2_INDEX(vaddr);
@@ -180,7 +206,9 @@ pt_copyonwrite(struct page_table* pt, vaddr_t vaddr)
     KASSERT(old_pte->pte_refcount > 1);
     
     old_pte->pte_refcount--;    
-    struct pt_entry *new_pte = pte_copy_deep(vaddr, old_pte);
+    if (old_pte->pte_inmem)
+        core_unshare(MAKE_ADDR(old_pte->pte_frame, 0), owner);
+    struct pt_entry *new_pte = pte_copy_deep(vaddr, old_pte, owner);
     
     // put the new PTE in the page table and return
     pt->pt_index[l1_idx][l2_idx] = new_pte;
@@ -234,32 +262,40 @@ pt_acquire_entry(struct page_table *pt, vaddr_t vaddr)
     unsigned long l2_idx = L2_INDEX(vaddr);
     
     /*
-     * We will only be acquiring our own entries.  Since
-     * there are no multithreaded processes in this system,
-     * we do not need to worry about partially created PTEs
+     * Other threads of the process may be adding entries as we
+     * look (under as_ptlock), but a table or entry is filled in
+     * before it is stored, so we never see one half made.
      */
-    if (pt->pt_index[l1_idx] == NULL)
-        return NULL;
-    
-    struct pt_entry *pte = pt->pt_index[l1_idx][l2_idx];
-    if (pte == NULL)
-        return NULL;
-    
-    // wait until the PTE becomes available
-    // If the PTE is being paged in, wait on swap
-    while (!pte_try_lock(pte)) {
-        swap_wait_lock();
-        if (pte->pte_swapin)
-            swap_wait();
-        else
-            swap_wait_unlock();
+    struct pt_entry *pte;
+    while (1) {
+        if (pt->pt_index[l1_idx] == NULL)
+            return NULL;
+        
+        pte = pt->pt_index[l1_idx][l2_idx];
+        if (pte == NULL)
+            return NULL;
+        
+        // wait until the PTE becomes available
+        // If the PTE is being paged in, wait on swap
+        while (!pte_try_lock(pte)) {
+            swap_wait_lock();
+            if (pte->pte_swapin)
+                swap_wait();
+            else
+                swap_wait_unlock();
+        }
+        
+        // a copy-on-write fault in another thread may have
+        // replaced the entry while we waited; if so, go again
+        if (pt->pt_index[l1_idx][l2_idx] == pte)
+            return pte;
+        pte_unlock(pte);
     }
-    
-    return pte;
 }
 
 // The created entry is locked.  It must be unlocked with
 // pte_unlock() when the operations on it are complete
+// The address space's as_ptlock must be held
 struct pt_entry *
 pt_create_entry(struct page_table *pt, vaddr_t vaddr, paddr_t frame)
 {
@@ -300,7 +336,8 @@ pt_create_entry(struct page_table *pt, vaddr_t vaddr, paddr_t frame)
     pte->pte_swapin = 0;
     pte->pte_frame = PAGE_NUM(frame);
     
-    // save our new structures
+    // save our new structures, the table last, so that
+    // pt_acquire_entry never finds it without the entry
     l2_tbl[l2_idx] = pte;
     pt->pt_index[l1_idx] = l2_tbl;
     
@@ -330,11 +367,13 @@ pt_destroy_entry(struct page_table *pt, vaddr_t vaddr)
 
 /************ Page Table Entry Helper Functions ************/
 
-// if the pte has no more references to it, destroy it
+// if the pte has no more references to it, destroy it;
+// otherwise OWNER, which no longer maps it, drops any
+// charge it holds on the frame
 // the PTE must be locked
 static
 void
-pte_destroy(struct pt_entry *pte)
+pte_destroy(struct pt_entry *pte, struct addrspace *owner)
 {
     KASSERT(pte != NULL);
     
@@ -353,14 +392,21 @@ pte_destroy(struct pt_entry *pte)
             if (pte->pte_dirty)
                 vs_decr_ram_dirty();
         }
-        else
+        else {
+            core_uncharge_swap(pte->pte_swapblk);
             swap_free(pte->pte_swapblk);
+        }
         
         // free the PTE
         kfree(pte);
     }
-    else
+    else {
+        // the frame must no longer look like OWNER's, or eviction
+        // would take it for a dying address space's page
+        if (pte->pte_inmem)
+            core_unshare(MAKE_ADDR(pte->pte_frame, 0), owner);
         pte_unlock(pte);
+    }
 }
 
 // Must be called with the PTE locked
@@ -382,7 +428,7 @@ pte_incr_ref(struct pt_entry *pte)
 // If refcount is too high, makes a deep copy
 static
 struct pt_entry *
-pte_copy(vaddr_t vaddr, struct pt_entry *old_pte)
+pte_copy(vaddr_t vaddr, struct pt_entry *old_pte, struct addrspace *owner)
 {
     KASSERT(old_pte != NULL);
     KASSERT(old_pte->pte_busy);
@@ -393,7 +439,7 @@ pte_copy(vaddr_t vaddr, struct pt_entry *old_pte)
         return old_pte;
     }
     else
-        return pte_copy_deep(vaddr, old_pte);
+        return pte_copy_deep(vaddr, old_pte, owner);
 }
 
 // Must be called with old PTE locked
@@ -403,7 +449,7 @@ pte_copy(vaddr_t vaddr, struct pt_entry *old_pte)
 // On failure, returns NULL.
 static
 struct pt_entry *
-pte_copy_deep(vaddr_t vaddr, struct pt_entry *old_pte)
+pte_copy_deep(vaddr_t vaddr, struct pt_entry *old_pte, struct addrspace *owner)
 {
     KASSERT(old_pte != NULL);
     KASSERT(old_pte->pte_busy);
@@ -445,7 +491,7 @@ pte_copy_deep(vaddr_t vaddr, struct pt_entry *old_pte)
     }
     
     // update the coremap
-    core_map_frame(new_frame, vaddr, new_pte, new_swapblk);
+    core_map_frame(new_frame, vaddr, new_pte, new_swapblk, owner);
     core_release_frame(new_frame);
     
     new_pte->pte_busy = 1;
@@ -533,9 +579,10 @@ pte_refresh(vaddr_t vaddr, struct pt_entry *pte)
         vs_incr_ram_inactive();
         // invalidate TLBs
         tlb_invalidate(vaddr, pte);
-        struct tlbshootdown *ts = ts_create(TS_INVAL, vaddr, pte);
-        ipi_tlbbroadcast(ts);
-        ts_return(ts);
+        struct tlbshootdown ts;
+        spinlock_data_t pending;
+        ts_init(&ts, TS_INVAL, vaddr, pte, &pending);
+        ipi_tlbbroadcast(&ts);
     }
     
     return active;
@@ -574,9 +621,10 @@ pte_start_cleaning(vaddr_t vaddr, struct pt_entry *pte)
     
     // clean TLBs
     tlb_clean(vaddr, pte);
-    struct tlbshootdown *ts = ts_create(TS_CLEAN, vaddr, pte);
-    ipi_tlbbroadcast(ts);
-    ts_return(ts);
+    struct tlbshootdown ts;
+    spinlock_data_t pending;
+    ts_init(&ts, TS_CLEAN, vaddr, pte, &pending);
+    ipi_tlbbroadcast(&ts);
 }
 
 // Must be called with the PTE locked
@@ -609,6 +657,34 @@ pte_evict(struct pt_entry *pte, swapidx_t swapblk)
     pte->pte_swapblk = swapblk;
 }
 
+// Must be called with the PTE locked
+bool
+pte_is_shared(struct pt_entry *pte)
+{
+    KASSERT(pte != NULL);
+    KASSERT(pte->pte_busy);
+    return pte->pte_refcount > 1;
+}
+
+// redirect the PTE to its swap block, dropping any unsaved changes;
+// only for pages that will never be read again
+// Must be called with the PTE locked
+void
+pte_discard(struct pt_entry *pte, swapidx_t swapblk)
+{
+    KASSERT(pte != NULL);
+    KASSERT(pte->pte_busy);
+    KASSERT(pte->pte_inmem);
+    
+    // update statistics
+    if (pte->pte_dirty)
+        vs_decr_ram_dirty();
+    
+    pte->pte_dirty = 0;
+    pte->pte_cleaning = 0;
+    pte_evict(pte, swapblk);
+}
+
 // Must be called with the PTE locked and the page in swap
 swapidx_t
 pte_start_swapin(struct pt_entry *pte, paddr_t frame)
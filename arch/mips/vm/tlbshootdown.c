@@ -29,81 +29,59 @@
  
 #include <mips/vm.h>
 #include <mips/tlb.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <thread.h>
 #include <lib.h> 
 
-#define TOTAL_SHOOTDOWNS TLBSHOOTDOWN_MAX
- 
-static struct tlbshootdown *ts_pool[TOTAL_SHOOTDOWNS];
-static int                  tp_index;
-static struct lock         *tp_lock;
-static struct cv           *tp_cv;
+// How many times to poll for completion before yielding the cpu
+#define TS_SPINS 1000
 
-// Get a shootdown struct from the pool and fill it
-struct tlbshootdown *
-ts_create(int type, vaddr_t vaddr, struct pt_entry *pte)
+// Fill in a shootdown; PENDING is the initiator's completion count
+void
+ts_init(struct tlbshootdown *ts, int type, vaddr_t vaddr,
+        struct pt_entry *pte, volatile spinlock_data_t *pending)
 {
-    lock_acquire(tp_lock);
-    
-    // Wait if there are no shootdowns available
-    while (tp_index == TOTAL_SHOOTDOWNS)
-        cv_wait(tp_cv, tp_lock);
-    
-    // Get the next available shootdown
-    struct tlbshootdown *ts = ts_pool[tp_index];
-    tp_index++;
-    
-    lock_release(tp_lock);
-    
     ts->ts_type = type;
     ts->ts_vaddr = vaddr;
     ts->ts_pte = pte;
-    
-    return ts;
+    ts->ts_pending = pending;
 }
 
-// Return a shootdown struct to the pool
+// Set how many cpus must finish before ts_wait returns;
+// called before any of them are sent the shootdown
 void
-ts_return(struct tlbshootdown *ts)
+ts_expect(const struct tlbshootdown *ts, unsigned ncpus)
 {
-    lock_acquire(tp_lock);
-    KASSERT(tp_index > 0);
-    
-    tp_index--;
-    ts_pool[tp_index] = ts;
-    
-    lock_release(tp_lock);
+    spinlock_data_set(ts->ts_pending, ncpus);
 }
- 
-// Allocates all the shootdown structs in the pool
+
+// Take back NCPUS of those expected that were never sent it
 void
-ts_bootstrap()
+ts_unexpect(const struct tlbshootdown *ts, unsigned ncpus)
 {
-    tp_lock = lock_create("TLB Shootdown Pool Lock");
-    if (tp_lock == NULL)
-        panic("ts_bootstrap: Out of memory\n");
-    tp_cv = cv_create("TLB Shootdown Pool CV");
-    if (tp_cv == NULL)
-        panic("ts_bootstrap: Out of memory\n");
-    
-    for (int i = 0; i < TOTAL_SHOOTDOWNS; i++) {
-        ts_pool[i] = kmalloc(sizeof(struct tlbshootdown));
-        if (ts_pool[i] == NULL)
-            panic("ts_bootstrap: Out of memory\n");
-        ts_pool[i]->ts_sem = sem_create("TLB Shootdown Semaphore", 0);
-        if (ts_pool[i]->ts_sem == NULL)
-            panic("ts_bootstrap: Out of memory\n");
-    }
+    spinlock_data_fetchadd(ts->ts_pending, -ncpus);
 }
- 
+
+// Wait for every target cpu to finish. They do so from their
+// IPI handlers, which is quick, so spin for a while first; if
+// some cpu has interrupts off for longer, let others run.
 void
 ts_wait(const struct tlbshootdown *ts)
 {
-    P(ts->ts_sem);
+    int spins = 0;
+    
+    while (spinlock_data_get(ts->ts_pending) != 0) {
+        if (++spins == TS_SPINS) {
+            thread_yield();
+            spins = 0;
+        }
+    }
 }
- 
+
+// Called by a target cpu when done; the initiator may return
+// (and the shootdown go out of scope) as soon as this lands
 void
 ts_finish(const struct tlbshootdown *ts)
 {
-    V(ts->ts_sem);
+    spinlock_data_fetchadd(ts->ts_pending, (unsigned)-1);
 }
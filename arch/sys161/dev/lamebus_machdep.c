@@ -242,6 +242,21 @@ mainbus_send_ipi(struct cpu *target)
 	lamebus_assert_ipi(lamebus, target);
 }
 
+/*
+ * Set the on-chip timer to go off TICKS hardclocks from now. The count
+ * it takes is 32 bits, which bounds how far off that can be.
+ */
+void
+mainbus_settimer(unsigned ticks)
+{
+	const unsigned max = 0xffffffff / (CPU_FREQUENCY / HZ);
+
+	if (ticks > max) {
+		ticks = max;
+	}
+	mips_timer_set(ticks * (CPU_FREQUENCY / HZ));
+}
+
 /*
  * Interrupt dispatcher.
  */
@@ -259,13 +274,21 @@ mainbus_interrupt(struct trapframe *tf)
 	/* interrupts should be off */
 	KASSERT(curthread->t_curspl > 0);
 
+	/* If the timer was stopped for idle, restart it and catch up */
+	hardclock_resume();
+
 	cause = tf->tf_cause;
 	if (cause & LAMEBUS_IRQ_BIT) {
 		lamebus_interrupt(lamebus);
 	}
 	else if (cause & LAMEBUS_IPI_BIT) {
-		interprocessor_interrupt();
+		/*
+		 * Clear first: senders post their work before raising
+		 * the IPI, so anything posted after we look raises it
+		 * again instead of being lost.
+		 */
 		lamebus_clear_ipi(lamebus, curcpu);
+		interprocessor_interrupt();
 	}
 	else if (cause & MIPS_TIMER_BIT) {
 		/* Reset the timer (this clears the interrupt) */
@@ -57,6 +57,8 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
+#include <process.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -68,10 +70,10 @@
 static struct con_softc *the_console = NULL;
 
 /*
- * Lock so user I/Os are atomic.
- * We use two locks so readers waiting for input don't lock out writers.
+ * Lock so user writes are atomic. User reads are made atomic by
+ * cs_reader instead, so readers waiting for input don't lock out
+ * writers and can give up if their process exits.
  */
-static struct lock *con_userlock_read = NULL;
 static struct lock *con_userlock_write = NULL;
 
 //////////////////////////////////////////////////
@@ -153,8 +155,35 @@ putch_intr(struct con_softc *cs, int ch)
 	cs->cs_send(cs->cs_devdata, ch);
 }
 
+/*
+ * True if the current thread should stop waiting for input because
+ * its process is exiting. Call with cs_rlock held, so that a
+ * getch_interrupt() after ps_exiting is set can't be missed.
+ */
+static
+bool
+con_interrupted(void)
+{
+	return curthread->t_proc != NULL && curthread->t_proc->ps_exiting;
+}
+
+/*
+ * Sleep on cs_rwchan. Call with cs_rlock held; it is held again on
+ * return.
+ */
+static
+void
+con_rsleep(struct con_softc *cs)
+{
+	wchan_lock(cs->cs_rwchan);
+	spinlock_release(&cs->cs_rlock);
+	wchan_sleep(cs->cs_rwchan);
+	spinlock_acquire(&cs->cs_rlock);
+}
+
 /*
  * Read a character, using interrupts to wait for I/O completion.
+ * Returns -1 if interrupted (see con_interrupted).
  */
 static
 int
@@ -162,10 +191,18 @@ getch_intr(struct con_softc *cs)
 {
 	unsigned char ret;
 
-	P(cs->cs_rsem);
+	spinlock_acquire(&cs->cs_rlock);
+	while (cs->cs_gotchars_head == cs->cs_gotchars_tail) {
+		if (con_interrupted()) {
+			spinlock_release(&cs->cs_rlock);
+			return -1;
+		}
+		con_rsleep(cs);
+	}
 	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
 	cs->cs_gotchars_tail =
 		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
+	spinlock_release(&cs->cs_rlock);
 	return ret;
 }
 
@@ -173,10 +210,7 @@ getch_intr(struct con_softc *cs)
  * Called from underlying device when a read-ready interrupt occurs.
  *
  * Note: if gotchars_head == gotchars_tail, the buffer is empty. Thus
- * if gotchars_head+1 == gotchars_tail, the buffer is full. A slightly
- * tidier way to implement this check (that avoids wasting a slot,
- * too) would be with a second semaphore used with a nonblocking P,
- * but we don't have that in OS/161.
+ * if gotchars_head+1 == gotchars_tail, the buffer is full.
  */
 void
 con_input(void *vcs, int ch)
@@ -184,16 +218,20 @@ con_input(void *vcs, int ch)
 	struct con_softc *cs = vcs;
 	unsigned nexthead;
 
+	spinlock_acquire(&cs->cs_rlock);
 	nexthead = (cs->cs_gotchars_head + 1) % CONSOLE_INPUT_BUFFER_SIZE;
 	if (nexthead == cs->cs_gotchars_tail) {
 		/* overflow; drop character */
+		spinlock_release(&cs->cs_rlock);
 		return;
 	}
 
 	cs->cs_gotchars[cs->cs_gotchars_head] = ch;
 	cs->cs_gotchars_head = nexthead;
 
-	V(cs->cs_rsem);
+	/* readers waiting for cs_reader share the channel; wake all */
+	wchan_wakeall(cs->cs_rwchan);
+	spinlock_release(&cs->cs_rlock);
 }
 
 /*
@@ -275,6 +313,19 @@ getch(void)
 	return getch_intr(cs);
 }
 
+void
+getch_interrupt(void)
+{
+	struct con_softc *cs = the_console;
+
+	if (cs == NULL) {
+		return;
+	}
+	spinlock_acquire(&cs->cs_rlock);
+	wchan_wakeall(cs->cs_rwchan);
+	spinlock_release(&cs->cs_rlock);
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -298,6 +349,55 @@ con_close(struct device *dev)
 	return 0;
 }
 
+/*
+ * Read a line for the user. One reader at a time gets the input;
+ * the others wait for it to finish, or give up like getch_intr.
+ */
+static
+int
+con_read(struct con_softc *cs, struct uio *uio)
+{
+	int result, c;
+	char ch;
+
+	spinlock_acquire(&cs->cs_rlock);
+	while (cs->cs_reader != NULL) {
+		if (con_interrupted()) {
+			spinlock_release(&cs->cs_rlock);
+			return EINTR;
+		}
+		con_rsleep(cs);
+	}
+	cs->cs_reader = curthread;
+	spinlock_release(&cs->cs_rlock);
+
+	result = 0;
+	while (uio->uio_resid > 0) {
+		c = getch();
+		if (c < 0) {
+			result = EINTR;
+			break;
+		}
+		ch = c;
+		if (ch=='\r') {
+			ch = '\n';
+		}
+		result = uiomove(&ch, 1, uio);
+		if (result) {
+			break;
+		}
+		if (ch=='\n') {
+			break;
+		}
+	}
+
+	spinlock_acquire(&cs->cs_rlock);
+	cs->cs_reader = NULL;
+	wchan_wakeall(cs->cs_rwchan);
+	spinlock_release(&cs->cs_rlock);
+	return result;
+}
+
 static
 int
 con_io(struct device *dev, struct uio *uio)
@@ -306,44 +406,24 @@ con_io(struct device *dev, struct uio *uio)
 	char ch;
 	struct lock *lk;
 
-	(void)dev;  // unused
-
 	if (uio->uio_rw==UIO_READ) {
-		lk = con_userlock_read;
-	}
-	else {
-		lk = con_userlock_write;
+		return con_read(dev->d_data, uio);
 	}
 
+	lk = con_userlock_write;
 	KASSERT(lk != NULL);
 	lock_acquire(lk);
 
 	while (uio->uio_resid > 0) {
-		if (uio->uio_rw==UIO_READ) {
-			ch = getch();
-			if (ch=='\r') {
-				ch = '\n';
-			}
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				break;
-			}
+		result = uiomove(&ch, 1, uio);
+		if (result) {
+			lock_release(lk);
+			return result;
 		}
-		else {
-			result = uiomove(&ch, 1, uio);
-			if (result) {
-				lock_release(lk);
-				return result;
-			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
+		if (ch=='\n') {
+			putch('\r');
 		}
+		putch(ch);
 	}
 	lock_release(lk);
 	return 0;
@@ -398,8 +478,9 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
-	struct lock *rlk, *wlk;
+	struct wchan *rwchan;
+	struct semaphore *wsem;
+	struct lock *wlk;
 
 	/*
 	 * Only allow one system console.
@@ -414,36 +495,30 @@ config_con(struct con_softc *cs, int unit)
 	}
 	KASSERT(the_console==NULL);
 
-	rsem = sem_create("console read", 0);
-	if (rsem == NULL) {
+	rwchan = wchan_create("console read");
+	if (rwchan == NULL) {
 		return ENOMEM;
 	}
 	wsem = sem_create("console write", 1);
 	if (wsem == NULL) {
-		sem_destroy(rsem);
-		return ENOMEM;
-	}
-	rlk = lock_create("console-lock-read");
-	if (rlk == NULL) {
-		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(rwchan);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
-		lock_destroy(rlk);
-		sem_destroy(rsem);
+		wchan_destroy(rwchan);
 		sem_destroy(wsem);
 		return ENOMEM;
 	}
 
-	cs->cs_rsem = rsem;
+	spinlock_init(&cs->cs_rlock);
+	cs->cs_rwchan = rwchan;
+	cs->cs_reader = NULL;
 	cs->cs_wsem = wsem;
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
 
 	the_console = cs;
-	con_userlock_read = rlk;
 	con_userlock_write = wlk;
 
 	flush_delay_buf();
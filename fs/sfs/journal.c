@@ -379,7 +379,9 @@ jnl_docheckpoint(struct journal *jnl)
 int
 sfs_jnlmount(struct sfs_fs *sfs, uint64_t txnid_next, daddr_t checkpoint)
 {
-    struct journal *jnl = kmalloc(sizeof(struct journal));
+    // The journal buffers span several pages and are touched under
+    // jnl_lock on every transaction, so back them up front
+    struct journal *jnl = kmalloc_eager(sizeof(struct journal));
     if (jnl == NULL)
         return ENOMEM;
     jnl->jnl_lock = lock_create("SFS Journal Lock");
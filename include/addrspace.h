@@ -84,10 +84,25 @@ struct addrspace {
 #else
     unsigned int        as_id;
 	struct page_table  *as_pgtbl;
+    // serializes adding entries to as_pgtbl and copying it, as
+    // user threads fault on it concurrently (see page_fault.c)
+    struct lock        *as_ptlock;
     // NSEGS + the stack and heap
     struct segment      as_segs[NSEGS + 2];
     // turn off write protection while loading segments
     bool                as_loading;
+    
+    // memory accounting (protected by the coremap lock; see coremem.c)
+    // Each frame is charged to the address space that brought it in.
+    size_t              as_rss;       // # of resident frames charged here
+    size_t              as_nswap;     // # of charged pages evicted to swap
+    swapidx_t           as_swaplist;  // first of those blocks (see swap.c)
+    size_t              as_rss_limit; // resident limit in pages (0 = none)
+    
+    // teardown in the background (see as_destroy)
+    volatile bool       as_dying;     // queued; eviction discards its pages
+    struct addrspace   *as_reapnext;  // next on the reaper's queue
+    unsigned            as_reappos;   // progress through the page table
 };
 
 // Macros for the stack and heap
@@ -128,6 +143,10 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_threadstack - grow the stack region down to cover the
+ *                stack of user thread N, the Nth below the main one
+ *                (which is 0), and hand back its initial stack pointer.
  */
 
 struct addrspace *as_create(void);
@@ -143,6 +162,8 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_threadstack(struct addrspace *as, int n,
+                                        vaddr_t *initstackptr);
 
 
 
@@ -157,12 +178,21 @@ int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
  *
  *    as_sbrk - extends the heap by <amount> and returns the vaddr
  *                  of the previous heap top.
+ *
+ *    as_memstat - fills in the address space's resident/swap usage
+ *                  and resident limit.
  */
  
 #if !(OPT_DUMBVM)
+struct memstat;
+
+// Set up background address space teardown; called from vm_bootstrap
+void as_reaper_bootstrap(void);
+
 bool as_can_read(struct addrspace *as, vaddr_t vaddr);
 bool as_can_write(struct addrspace *as, vaddr_t vaddr);
 int as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *old_heaptop);
+void as_memstat(struct addrspace *as, struct memstat *ms);
 #endif
 
 
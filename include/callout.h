@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _CALLOUT_H_
+#define _CALLOUT_H_
+
+/*
+ * Callouts: run a function a given number of hardclocks from now.
+ *
+ * Each cpu has a hashed timer wheel, advanced by its hardclock(). A
+ * callout goes on the wheel of the cpu that schedules it, in the
+ * bucket for its expiry tick modulo the wheel size, so arming,
+ * cancelling and each tick cost O(1) plus the callouts in one bucket.
+ *
+ * The function is called from the timer interrupt on that cpu, so it
+ * must not sleep; to do work that might, wake a thread. It may
+ * reschedule its own callout. A callout must not be freed while it is
+ * pending or its function is running.
+ *
+ * The structure is public so callouts can be embedded in other
+ * structures or live on the stack; use the functions below on it.
+ */
+
+struct callout {
+	struct callout *co_next;	/* bucket link */
+	struct callout **co_prevp;	/* what points to us */
+	int co_wheel;			/* cpu of wheel we're on, or -1 */
+	unsigned co_expire;		/* wheel tick to fire at */
+	void (*co_func)(void *);	/* what to call */
+	void *co_arg;			/* ... and its argument */
+};
+
+/*
+ * Functions:
+ *
+ * callout_init		Set up CO to call FUNC(ARG). Not pending.
+ * callout_schedule	(Re)arm CO to fire TICKS hardclocks from now
+ *			(at least 1).
+ * callout_stop		Cancel CO if pending; return true if it was.
+ *			Does not wait for a call already under way.
+ * callout_pending	True if CO is armed and hasn't fired yet.
+ *
+ * callout_ticks	Convert a time to hardclocks, rounding up.
+ */
+void callout_init(struct callout *co, void (*func)(void *), void *arg);
+void callout_schedule(struct callout *co, unsigned ticks);
+bool callout_stop(struct callout *co);
+bool callout_pending(struct callout *co);
+
+unsigned callout_ticks(time_t secs, uint32_t nsecs);
+
+/* Call once during system startup, before interrupts come on. */
+void callout_bootstrap(void);
+
+/* Run this cpu's expired callouts. Called from hardclock(). */
+void callout_hardclock(void);
+
+/*
+ * Hardclocks until the next callout on this cpu's wheel is due, or MAX
+ * if none is due sooner. Used to decide how long an idle cpu can go
+ * without ticks.
+ */
+unsigned callout_nextevent(unsigned max);
+
+#endif /* _CALLOUT_H_ */
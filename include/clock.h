@@ -36,10 +36,14 @@
  * Time-related definitions.
  *
  * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * when the CPU is not idle, for scheduling. An idle CPU calls
+ * hardclock_idle() to stop its clock until the next callout is due;
+ * hardclock_resume(), called when anything wakes it, restarts the
+ * clock and catches up on the hardclocks that were skipped.
  *
  * timerclock() is called on one CPU once a second to allow simple
- * timed operations. (This is a fairly simpleminded interface.)
+ * timed operations. (This is a fairly simpleminded interface; for
+ * finer-grained timing see callout.h.)
  *
  * gettime() may be used to fetch the current time of day.
  * getinterval() computes the time from time1 to time2.
@@ -57,10 +61,14 @@
 #endif
 
 void hardclock_bootstrap(void);
+void hardclock_tickless_bootstrap(void);
 
 void hardclock(void);
 void timerclock(void);
 
+void hardclock_idle(void);
+void hardclock_resume(void);
+
 void gettime(time_t *seconds, uint32_t *nanoseconds);
 
 void getinterval(time_t secs1, uint32_t nsecs,
@@ -73,5 +81,11 @@ void getinterval(time_t secs1, uint32_t nsecs,
  */
 void clocksleep(int seconds);
 
+/*
+ * clocknanosleep() suspends execution for at least the given time,
+ * rounded up to a whole number of hardclocks.
+ */
+void clocknanosleep(time_t seconds, uint32_t nanoseconds);
+
 
 #endif /* _CLOCK_H_ */
@@ -33,35 +33,64 @@
 #include <swap.h>
 #include <page_table.h>
 
+struct addrspace;
+
 /*
  * Physical memory management operations:
  *
  * core_bootstrap - set up the core map (must be called after ram_bootstrap())
  *
  * core_acquire_frame - find and lock a free page frame for manipulation.
+ *                  If a full sweep of the coremap finds nothing, the
+ *                  caller sleeps until a frame is freed or cleaned
+ *                  (unless it is in an interrupt or holds a spinlock).
  *
  * core_acquire_random - find and lock a free page frame for manipulation
  *                  using random eviction.
  *
+ * core_acquire_frames - find and lock nframes free page frames at once,
+ *                  storing them in frames[].  Returns the number of frames
+ *                  acquired, which is less than nframes only when out of
+ *                  memory.
+ *
  * core_release_frame - release a locked page frame after manipulating it.
  *
- * core_map_frame - map a page frame to a PTE and swap block
- *                  (must hold the page frame lock, i.e., have called
- *                  core_acquire_frame)
+ * core_map_frame - map a page frame to a PTE and swap block, charging
+ *                  it to OWNER's resident set (must hold the page frame
+ *                  lock, i.e., have called core_acquire_frame).  Frames of
+ *                  an owner over its resident limit are evicted first.
  *
  * core_reserve_frame - reserve a frame for kernel use.  Thereafter,
  *                  until the frame is freed, the frame's contents cannot be
  *                  evicted.
  *
  * core_free_frame - indicate that a page frame is no longer being used
+ *
+ * core_uncharge_swap - note that the page in SWAPBLK has come back from
+ *                  swap or been freed there, uncharging the address
+ *                  space that was charged when it was evicted.
+ *
+ * core_unshare - note that AS no longer maps FRAME, which other address
+ *                  spaces still share; if AS was charged for it, the
+ *                  charge is dropped.
+ *
+ * core_disown - drop any charges to AS still held by frames or swapped
+ *                  pages (for those shared copy-on-write with other
+ *                  address spaces).
+ *                  Call after destroying AS's page table.
  */
 void    core_bootstrap(void);
 paddr_t core_acquire_frame(void);
+unsigned core_acquire_frames(paddr_t *frames, unsigned nframes);
 void    core_release_frame(paddr_t frame);
 void    core_map_frame(paddr_t frame, vaddr_t vaddr,
-                       struct pt_entry *pte, swapidx_t swapblk);
+                       struct pt_entry *pte, swapidx_t swapblk,
+                       struct addrspace *owner);
 void    core_reserve_frame(paddr_t frame);
 void    core_free_frame(paddr_t frame);
+void    core_uncharge_swap(swapidx_t swapblk);
+void    core_unshare(paddr_t frame, struct addrspace *as);
+void    core_disown(struct addrspace *as);
 
 // start core cleaner daemon
 void core_cleaner_bootstrap(void);
@@ -37,6 +37,18 @@
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
+/*
+ * A slot in a cpu's TLB shootdown ring. Slot I is free for the sender
+ * claiming position P (P mod IPI_RINGSIZE == I) when is_seq is P,
+ * and holds a shootdown for the cpu to take when it is P + 1.
+ */
+struct ipi_slot {
+	volatile spinlock_data_t is_seq;
+	struct tlbshootdown is_ts;
+};
+
+#define IPI_RINGSIZE  (2 * TLBSHOOTDOWN_MAX)
+
 /*
  * Per-cpu structure
  *
@@ -60,9 +72,19 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_threadcache; /* Dead threads kept for reuse */
     struct pid_set *c_orphans; /* List of exited processes */
     struct asid_table *c_asids; /* Record of ASID assignments */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	unsigned c_idleclocks;		/* ... of those skipped while idle */
+	unsigned c_tickless;		/* Hardclocks timer is off for, or 0;
+					   read by others only as a hint */
+	time_t c_ticklesssecs;		/* Time it went off */
+	uint32_t c_ticklessnsecs;
+	unsigned c_migrations;		/* Threads this cpu moved between cpus */
+	unsigned c_switches;		/* Context switches on this cpu */
+	struct thread *c_departing;	/* Thread leaving (see thread_switch) */
+	struct thread *c_idlethread;	/* Runs when it has nowhere to go */
 
 	/*
 	 * Accessed by other cpus.
@@ -71,29 +93,32 @@ struct cpu {
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
+	uint64_t c_minvruntime;		/* Fair-share clock; see thread.c */
 
 	/*
-	 * Accessed by other cpus.
-	 * Protected by the IPI lock.
+	 * Accessed by other cpus, without locking.
 	 *
-	 * If c_numshootdown is -1 (TLBSHOOTDOWN_ALL), all mappings
-	 * should be invalidated. This is used if more than
-	 * TLBSHOOTDOWN_MAX mappings are going to be invalidated at
-	 * once. TLBSHOOTDOWN_MAX is MD and chosen based on when it
-	 * becomes more efficient just to flush the whole TLB.
+	 * Senders set bits in c_ipi_pending with compare-and-swap, and
+	 * the cpu takes them all at once the same way. TLB shootdowns
+	 * go in c_shootdown, a ring that any number of cpus can add to
+	 * at once and only this cpu takes from: a sender claims the
+	 * slot at c_shootdown_tail by advancing it, fills it in, then
+	 * publishes it by advancing the slot's is_seq (see
+	 * ipi_tlbshootdown). Each shootdown's initiator waits for it
+	 * to finish before starting another, so the ring only fills
+	 * if many threads start shootdowns at once; senders then wait
+	 * for this cpu to drain it.
 	 *
 	 * struct tlbshootdown is machine-dependent and might
 	 * reasonably be either an address space and vaddr pair, or a
 	 * paddr, or something else.
 	 */
-	uint32_t c_ipi_pending;		/* One bit for each IPI number */
-	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
-	int c_numshootdown;
-	struct spinlock c_ipi_lock;
+	volatile spinlock_data_t c_ipi_pending;	/* One bit per IPI number */
+	struct ipi_slot c_shootdown[IPI_RINGSIZE];
+	volatile spinlock_data_t c_shootdown_tail; /* Next slot to claim */
+	unsigned c_shootdown_head;	/* Next slot to take; this cpu only */
 };
 
-#define TLBSHOOTDOWN_ALL  (-1)
-
 /*
  * Initialization functions.
  *
@@ -117,6 +142,12 @@ void cpu_hatch(unsigned software_number);
  */
 const char *cpu_identify(void);
 
+/*
+ * Read the current CPU's free-running cycle counter. It wraps, so
+ * only differences of nearby readings are meaningful.
+ */
+uint32_t cpu_cycles(void);
+
 /*
  * Hardware-level interrupt on/off, for the current CPU.
  *
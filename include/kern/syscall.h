@@ -197,6 +197,13 @@
 #define SYS_reboot       119
 //#define SYS___sysctl   120
 #define SYS_vmstat       121
+#define SYS_memstat      122
+#define SYS_rsslimit     123
+#define SYS_setaffinity  124
+#define SYS_thread_create 125
+#define SYS_thread_join  126
+#define SYS_thread_exit  127
+#define SYS_futex        128
 
 /*CALLEND*/
 
@@ -30,6 +30,21 @@
 #ifndef _KERN_VMSTAT_H_
 #define _KERN_VMSTAT_H_
 
+/*
+ * Fault paths timed by the fault latency histograms.
+ */
+#define VS_FAULT_TLB     0  // reload of a resident page into the TLB
+#define VS_FAULT_ZERO    1  // first touch of an unmapped page
+#define VS_FAULT_SWAPIN  2  // page brought back in from swap
+#define VS_FAULT_COW     3  // copy-on-write of a shared page
+#define VS_NFAULTTYPES   4
+
+/*
+ * Bucket i of a histogram counts faults that took between 2^i and
+ * 2^(i+1) - 1 cycles.  The last bucket also holds anything longer.
+ */
+#define VS_NHISTBUCKETS  24
+
 /*
  * The vmstat structure, for returning VM statistics via vmstat().
  */
@@ -51,6 +66,21 @@ struct vmstat {
     // VM system statistics
     size_t vs_faults;       // # of times vm_fault() was called
     size_t vs_cow_faults;   // # of faults requiring copy-on-write
+    size_t vs_reclaim_waits;// # of times a thread slept waiting for a frame
+    
+    // Fault latency histograms, indexed by VS_FAULT_* and log2(cycles)
+    size_t vs_fault_hist[VS_NFAULTTYPES][VS_NHISTBUCKETS];
+};
+
+/*
+ * The memstat structure, for returning the calling process's memory
+ * usage via memstat().  Pages shared copy-on-write are charged to the
+ * process that brought them into memory.
+ */
+struct memstat {
+    size_t ms_rss;          // # of resident pages charged to the process
+    size_t ms_swap;         // # of its pages currently in swap
+    size_t ms_rss_limit;    // resident limit in pages (0 = no limit)
 };
 
 #endif /* _KERN_VMSTAT_H_ */
@@ -35,7 +35,11 @@
 /*
  * Kernel Virtual Memory
  *
- * kvm_alloc_contig - allocate a contiguous region of npages
+ * kvm_alloc_contig - allocate a contiguous region of npages.  If flags
+ *              contains KALLOC_EAGER (see vm.h), every page is backed
+ *              with a frame before returning, and the mappings are
+ *              preloaded into this CPU's TLB; otherwise pages are
+ *              backed lazily on first touch.
  *
  * kvm_free_contig - free a region allocated with kvm_alloc_contig()
  *
@@ -43,7 +47,7 @@
  *
  * kvm_fault - process a TLB fault in kernel space
  */
-vaddr_t kvm_alloc_contig(int npages);
+vaddr_t kvm_alloc_contig(int npages, int flags);
 void    kvm_free_contig(vaddr_t vaddr);
 bool    kvm_managed(vaddr_t vaddr);
 int     kvm_fault(vaddr_t faultaddr);
@@ -122,8 +122,12 @@ bool is_random_init(void);
 /*
  * Kernel heap memory allocation. Like malloc/free.
  * If out of memory, kmalloc returns NULL.
+ *
+ * kmalloc_eager is like kmalloc, but multi-page blocks are backed by
+ * physical memory at allocation time instead of on first touch.
  */
 void *kmalloc(size_t size);
+void *kmalloc_eager(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
 
@@ -157,11 +161,16 @@ const char *strerror(int errcode);
  * putch_prepare and putch_complete should be called around a series
  * of putch() calls, if printing in polling mode is a possibility.
  * kprintf does this.
+ *
+ * getch() returns -1 instead of waiting if the caller's process is
+ * exiting; whoever sets ps_exiting calls getch_interrupt() to wake
+ * threads already waiting so they notice.
  */
 void putch(int ch);
 void putch_prepare(void);
 void putch_complete(void);
 int getch(void);
+void getch_interrupt(void);
 void beep(void);
 
 /*
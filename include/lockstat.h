@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock contention profiling ("options lockstat").
+ *
+ * Locks are profiled by class, one class per lock name: all sleep
+ * locks created with the same name, and all spinlocks given the same
+ * name with spinlock_setname, are counted together. For each class
+ * we count acquisitions, contended acquisitions, total and longest
+ * wait, and total hold time, in cpu cycles. The counts are kept per
+ * cpu and updated with interrupts off, so recording takes no lock.
+ *
+ * There is room for LOCKSTAT_NCLASSES names; locks with any further
+ * names are lumped together in one "(other)" class.
+ */
+
+#define LOCKSTAT_NONE		(-1)	/* lock not profiled */
+#define LOCKSTAT_NCLASSES	48
+
+/* Find or make the class for NAME. */
+int lockstat_class(const char *name);
+
+/* Record an acquisition of a lock of class CLS, and its release. */
+void lockstat_acquired(int cls, bool contended, uint32_t waitcycles);
+void lockstat_released(int cls, uint32_t holdcycles);
+
+/* Print the totals for all classes, most waited-for first. */
+void lockstat_print(void);
+
+#endif /* _LOCKSTAT_H_ */
@@ -55,6 +55,13 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Make this cpu's next timer interrupt come TICKS hardclocks from now,
+ * instead of at the next one. Afterwards it goes back to interrupting
+ * every hardclock. (Low-level; used for tickless idle.)
+ */
+void mainbus_settimer(unsigned ticks);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
@@ -34,9 +34,18 @@
 
 struct pt_entry;
 struct page_table;
+struct addrspace;
 
 struct page_table  *pt_create(void);
-void                pt_destroy(struct page_table *pt);
+void                pt_destroy(struct page_table *pt, struct addrspace *owner);
+
+// Destroy up to BUDGET entries of PT, resuming at *POS (start at 0),
+// which is advanced past them.  Returns true once nothing is left, at
+// which point PT itself has been freed too.  OWNER is the address
+// space PT belonged to; it gives up its charge on any frame it was
+// still sharing.
+bool                pt_destroy_some(struct page_table *pt, unsigned *pos,
+                                    unsigned budget, struct addrspace *owner);
 
 /*
  * SYNCHRONIZATION:
@@ -46,7 +55,9 @@ void                pt_destroy(struct page_table *pt);
  *              i.e., the vaddr is unmapped.
  *
  * pt_create_entry - create and lock a page table entry for the page containing the
- *              specified virtual address.
+ *              specified virtual address.  Threads of one process share a page
+ *              table, so the caller must hold the address space's as_ptlock
+ *              and have checked under it that no entry exists.
  *
  * pt_destroy_entry - destroy a page table entry previously created with pt_create_entry().
  *              This should only be called on an error immediately after pt_create_entry().
@@ -69,7 +80,9 @@ void                pte_unlock(struct pt_entry *pte);
 // Used to deal with write faults that require copying
 // The PTE referred to by pt and vaddr must be locked
 // Makes a deep copy of the PTE and returns it, both PTE's are locked
-struct pt_entry *pt_copyonwrite(struct page_table* pt, vaddr_t vaddr);
+// The new frame is charged to OWNER
+struct pt_entry *pt_copyonwrite(struct page_table* pt, vaddr_t vaddr,
+                                struct addrspace *owner);
 
 bool pte_try_access(struct pt_entry *pte); // try to access the page
 bool pte_try_dirty(struct pt_entry *pte); // try to dirty the page
@@ -80,6 +93,9 @@ bool pte_refresh(vaddr_t vaddr, struct pt_entry *pte); // reset & return the "ac
                                                        // invalidate TLBs if necessary
 void pte_evict(struct pt_entry *pte, // evict the page to the swap block
                swapidx_t swapblk);
+bool pte_is_shared(struct pt_entry *pte); // check whether copy-on-write shared
+void pte_discard(struct pt_entry *pte, // evict without writing back, for pages
+                 swapidx_t swapblk);   // nothing will read again
 
 swapidx_t pte_start_swapin(struct pt_entry *pte, paddr_t frame); // mark as paging in
 void pte_finish_swapin(struct pt_entry *pte); // mark as paged in
@@ -88,9 +104,13 @@ void pte_start_cleaning(vaddr_t vaddr, struct pt_entry *pte);
 bool pte_finish_cleaning(struct pt_entry *pte); // returns true on successful clean
 
 // Deep copy of the page table and all the page table entries
-struct page_table *pt_copy_deep(struct page_table *old_pt);
+// New frames are charged to OWNER
+struct page_table *pt_copy_deep(struct page_table *old_pt,
+                                struct addrspace *owner);
 
 // Copy of page table with shallow copies of page table entries
-struct page_table *pt_copy_shallow(struct page_table *old_pt);
+// Any frames that must be copied are charged to OWNER
+struct page_table *pt_copy_shallow(struct page_table *old_pt,
+                                   struct addrspace *owner);
 
 #endif /* _PAGE_TABLE_H_ */
@@ -44,17 +44,52 @@ typedef enum _pstat_t {
     PS_ZOMBIE
 } pstat_t;
 
+// Most user threads a process can have at once. Thread N runs on the
+// Nth user stack down from USERSTACK (see as_define_threadstack).
+#define PROC_MAXTHREADS 16
+
+typedef enum _tstat_t {
+    TS_FREE,
+    TS_ACTIVE,
+    TS_ZOMBIE       // exited, waiting for thread_join()
+} tstat_t;
+
+// A user thread, indexed in ps_threads by its thread ID
+struct uthread {
+    tstat_t              ut_status;
+    struct thread       *ut_thread;         // kernel thread, once running
+    int                  ut_exitval;        // value passed to thread_exit()
+    vaddr_t              ut_entry;          // where a new thread starts
+    vaddr_t              ut_arg;            // ... its argument
+    vaddr_t              ut_stack;          // ... and its stack pointer
+    struct process      *ut_waiton;         // child it waits for, if any
+};
+
+/*
+ * A process has one or more user threads, each a kernel thread with
+ * t_proc pointing here, sharing the address space and FD table.
+ * When one thread calls _exit() or is killed, ps_exiting is set and
+ * the others leave the next time they are on their way back to user
+ * mode; the process becomes a zombie once they have gone. If the last
+ * thread leaves with thread_exit(), the process exits with status 0.
+ *
+ * ps_lock protects the status, exit code and thread table, and
+ * serializes changes to the address space's heap and stack segments.
+ */
 struct process {
     pid_t                ps_pid;            // unique process ID
     char                *ps_name;           // name for debugging
     volatile pstat_t     ps_status;         // execution status
     volatile int         ps_exit_code;      // exit code set by _exit()
-    struct thread       *ps_thread;         // associated thread
+    struct uthread       ps_threads[PROC_MAXTHREADS]; // threads by ID
+    unsigned             ps_nthreads;       // # of TS_ACTIVE threads
+    volatile bool        ps_exiting;        // other threads must leave
     struct fd_table     *ps_fdt;            // file descriptor table
     struct addrspace    *ps_addrspace;      // address space
     struct pid_set      *ps_children;       // PIDs of children
     struct cv           *ps_waitpid_cv;     // CV for waitpid()
-    struct lock         *ps_waitpid_lock;   // lock for waitpid()
+    struct cv           *ps_thread_cv;      // CV for thread join/exit
+    struct lock         *ps_lock;           // lock for all of the above
 };
 
 void process_bootstrap(void);
@@ -67,7 +102,9 @@ void process_destroy(pid_t pid); // remove and free process struct
 // unwind and set exit code (see kern/wait.h)
 void process_finish(struct process *p, int code);
 
-int process_waiton(struct process *p); // waits and returns exit code
+int process_waiton(struct process *p); // waits and returns exit code,
+                                       // or -1 if the caller's process
+                                       // is exiting
 int process_checkon(struct process *p); // returns -1 if process not dead
 
 pid_t process_identify(struct process *p); // assign PID--returns 0 on error
@@ -76,5 +113,27 @@ void process_cleanup(struct process *p); // only for fork() and process.c
 bool process_orphan(pid_t pid); // places processes on cpu's orphan set
                                 // used with pid_set_map
 bool process_check_destroy(pid_t pid);
+void process_reap_orphans(void); // reap exited orphans in the background
+
+// User threads. process_thread_reserve() claims thread ID TID for a
+// process's first thread, and process_thread_alloc() the lowest free
+// ID for another, along with its user stack; the kernel thread then
+// calls process_thread_attach() to take it up.
+void process_thread_reserve(struct process *p, int tid);
+int process_thread_alloc(struct process *p, vaddr_t entry, vaddr_t arg,
+                         int *tid);
+void process_thread_attach(struct process *p, int tid);
+void process_thread_unreserve(struct process *p, int tid); // undo either
+
+// wait for thread TID to exit, free its ID, and get its exit value
+int process_thread_join(struct process *p, int tid, int *exitval);
+
+// the current thread stops running in its process; they don't return
+void process_thread_exit(int exitval); // joinable; the last one exits
+void process_thread_leave(void); // as told to by ps_exiting
+
+// stop the process's other threads (for execv); EINTR if exiting
+int process_single(struct process *p);
+void process_thread_main(struct process *p); // curthread becomes ID 0
 
 #endif /* _PROCESS_H_ */
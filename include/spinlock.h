@@ -36,6 +36,9 @@
  */
 
 #include <cdefs.h>
+#include <lockstat.h>
+#include "opt-ticketlocks.h"
+#include "opt-lockstat.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -53,21 +56,51 @@
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
+ *
+ * A spinlock is either a test-and-set lock, which is cheapest when
+ * uncontended, or a ticket lock, which hands the lock to waiting CPUs
+ * in the order they arrived and has them spin reading lk_serving
+ * rather than all writing lk_lock. For a ticket lock lk_lock is the
+ * next ticket to hand out. With "options ticketlocks" every spinlock
+ * is a ticket lock; otherwise only the ones initialized as such.
+ *
+ * With "options lockstat", a spinlock given a name with spinlock_setname
+ * is profiled under that name (see lockstat.h); lk_acqtime is when the
+ * holder got it.
  */
 struct spinlock {
 	volatile spinlock_data_t lk_lock; /* The memory word where we spin. */
+	volatile spinlock_data_t lk_serving; /* Ticket now holding the lock. */
+	bool lk_ticket;			/* Ticket lock? */
 	struct cpu *lk_holder;		/* CPU holding this lock. */
+#if OPT_LOCKSTAT
+	int lk_stat;			/* Lockstat class, or LOCKSTAT_NONE. */
+	uint32_t lk_acqtime;		/* Cycle count when acquired. */
+#endif
 };
 
+#if OPT_LOCKSTAT
+#define SPINLOCK_STAT_INITIALIZER	, LOCKSTAT_NONE, 0
+#else
+#define SPINLOCK_STAT_INITIALIZER
+#endif
+
 /*
- * Initializer for cases where a spinlock needs to be static or global.
+ * Initializers for cases where a spinlock needs to be static or global.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#define SPINLOCK_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, \
+	  OPT_TICKETLOCKS, NULL SPINLOCK_STAT_INITIALIZER }
+#define SPINLOCK_TICKET_INITIALIZER \
+	{ SPINLOCK_DATA_INITIALIZER, SPINLOCK_DATA_INITIALIZER, true, NULL \
+	  SPINLOCK_STAT_INITIALIZER }
 
 /*
  * Spinlock functions.
  *
  * init		Initialize the contents of a spinlock.
+ * init_ticket	Same, but always make it a ticket lock.
+ * setname	Profile the lock under NAME, if lockstat is enabled.
  * cleanup	Opposite of init. Lock must be unlocked.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
@@ -77,6 +110,8 @@ struct spinlock {
  */
 
 void spinlock_init(struct spinlock *lk);
+void spinlock_init_ticket(struct spinlock *lk);
+void spinlock_setname(struct spinlock *lk, const char *name);
 void spinlock_cleanup(struct spinlock *lk);
 
 void spinlock_acquire(struct spinlock *lk);
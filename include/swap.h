@@ -37,6 +37,10 @@
 
 typedef uint32_t swapidx_t;
 
+#define SWAP_NONE ((swapidx_t)-1)   // no block, e.g. at the end of a list
+
+struct addrspace;
+
 // must be called after ram_bootstrap(), core_bootstrap(), and vfs_bootstrap()
 void swap_bootstrap(void);
 
@@ -45,6 +49,16 @@ void    swap_free(swapidx_t to_free);           // free a disk block
 int     swap_in(swapidx_t src, paddr_t dst);
 int     swap_out(paddr_t src, swapidx_t dst);
 
+// The address space charged for a page while it is in swap (see
+// coremem.c, which keeps the charges under its own lock).  set records
+// it, clear forgets it and returns the old one, and disown forgets AS
+// wherever it appears, as AS is going away.  Each address space's
+// blocks are kept on a list from its as_swaplist, so disown takes
+// time in proportion to as_nswap, not to the size of the disk.
+void    swap_set_owner(swapidx_t blk, struct addrspace *as);
+struct addrspace *swap_clear_owner(swapidx_t blk);
+void    swap_disown(struct addrspace *as);
+
 void    swap_wait_lock(void);   // call this before waiting on a swapin
 void    swap_wait(void);        // call this to wait on a swapin
 void    swap_wait_unlock(void);  // call this to cancel a wait
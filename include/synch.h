@@ -35,6 +35,7 @@
  */
 
 #include <spinlock.h>
+#include "opt-lockstat.h"
 
 /*
  * Dijkstra-style semaphore.
@@ -79,12 +80,39 @@ void V(struct semaphore *);
  * If so, it takes the lock.  Otherwise, it goes back to sleep.
  * Upon releasing the lock, a thread clears lk_holder to pass control to the
  * next thread on the queue.
+ *
+ * The lock is adaptive: while the holder is running on another cpu it
+ * will probably release the lock soon, so a thread that wants it spins
+ * for a while before going to sleep. lk_ncontended counts acquires
+ * that found the lock held, and lk_nspinwins those of them that got
+ * the lock by spinning without sleeping. Both are protected by
+ * lk_metalock.
+ *
+ * A thread that goes to sleep on the lock lends its priority to the
+ * holder (priority inheritance; see t_donated in thread.h), so a low
+ * priority holder can't be kept off the cpu by middling threads
+ * while a high priority one waits. lk_nwaiters counts the threads
+ * asleep in lock_acquire, and lk_donation is the best priority they
+ * have lent (PRIORITY_NONE if none); it can be stale-high until the
+ * last of them gets the lock. lk_nextheld links the holder's
+ * t_heldlocks list. lk_nwaiters and lk_donation are protected by the
+ * priority inheritance spinlock in synch.c, and lk_nwaiters also by
+ * lk_metalock.
  */
 struct lock {
 	char *lk_name;
 	struct spinlock lk_metalock;
 	struct wchan *lk_wchan; // the core of the lock
 	struct thread *volatile lk_holder; // current holder of the lock
+	unsigned lk_ncontended; // acquires that had to wait
+	unsigned lk_nspinwins; // ... and got the lock by spinning
+	unsigned lk_nwaiters; // threads asleep waiting for it
+	unsigned lk_donation; // best priority they lend the holder
+	struct lock *lk_nextheld; // next lock the holder holds
+#if OPT_LOCKSTAT
+	int lk_stat; // lockstat class (by name)
+	uint32_t lk_acqtime; // cycle count when acquired
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -121,7 +149,10 @@ void lock_destroy(struct lock *);
  *
  * A condition variable is implemented by a wait channel that
  * logically corresponds to a condition whose value may change.
- * Signals and broadcasts correspond to wakeone and wakeall, respectively.
+ * A woken waiter can't proceed until it gets the lock back, which the
+ * signaller is holding, so signals and broadcasts don't wake anyone:
+ * they move one or all of the waiters onto the lock's wait channel,
+ * and lock_release wakes them one at a time ("wait morphing").
  */
 
 struct cv {
@@ -156,20 +187,23 @@ void cv_broadcast(struct cv *cv, struct lock *lock);
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
  *
- * An rw_mutex consists of a lock, two CVs, and two integers representing
- * numbers of readers and writers.  (As there should never be more than
- * one writer, the latter is binary).  Readers wait on the reader CV
- * and writers wait on the writer CV.  A reader can acquire the mutex
- * if there are no writers present.  A writer can only acquire the mutex if
- * there are neither readers nor writers.
+ * An rw_mutex consists of a state word, a lock for writers, and two wait
+ * channels.  The state word holds the number of readers and a writer bit,
+ * and is updated with atomic operations, so a reader that finds no writer
+ * around gets in and out without touching anything else.
+ *
+ * Writers take rw_wlock to exclude each other, then set the writer bit.
+ * From then on new readers wait on rw_readers_wchan, and the writer waits
+ * on rw_drain_wchan for the readers already in to drain out; the last one
+ * out wakes it.  So a stream of readers can't starve a writer.  Finishing
+ * writing clears the bit and wakes the waiting readers.
  */
 struct rw_mutex {
     char            *rw_name;
-    struct lock     *rw_lock;
-    struct cv       *rw_reader_cv;
-    struct cv       *rw_writer_cv;
-    volatile int     rw_nreaders;
-    volatile int     rw_nwriters;
+    volatile spinlock_data_t rw_state;  // RW_WRITER | number of readers
+    struct lock     *rw_wlock;          // held by the (would-be) writer
+    struct wchan    *rw_readers_wchan;  // readers waiting for the writer
+    struct wchan    *rw_drain_wchan;    // writer waiting for readers
 };
 
 struct rw_mutex *rw_create(const char *name);
@@ -50,6 +50,7 @@ void enter_forked_process(void *child_tf, unsigned long trash);
 /* Enter user mode. Does not return. */
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
+void enter_new_thread(vaddr_t arg, vaddr_t stackptr, vaddr_t entrypoint);
 
 
 /*
@@ -66,6 +67,7 @@ int sys_fstat(int fd, userptr_t statptr);
 int sys_fsync(int fd);
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t req, userptr_t rem);
 
 // Added in Assignment 2:
 
@@ -94,5 +96,17 @@ int sys_chdir(const_userptr_t pathname, int *err);
 
 vaddr_t sys_sbrk(intptr_t amount, int *err);
 int sys_vmstat(userptr_t buf); // get VM system statistics
+int sys_memstat(userptr_t buf); // get this process's memory usage
+int sys_rsslimit(size_t npages); // set this process's resident limit
+
+int sys_setaffinity(uint32_t mask); // restrict to the CPUs in mask
+
+// user threads; thread_create returns the new thread's ID
+int sys_thread_create(userptr_t entry, userptr_t arg, int *err);
+int sys_thread_join(int tid, userptr_t status);
+int sys_thread_exit(int exitval);
+
+// sleep on or wake an int in user memory; see <kern/futex.h>
+int sys_futex(userptr_t uaddr, int op, int val, int *err);
 
 #endif /* _SYSCALL_H_ */
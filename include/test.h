@@ -63,6 +63,12 @@ int cvtest(int, char **);
 /* Assignment 1 unit tests */
 int fairlocktest(int, char **);
 
+/* scheduler benchmarks */
+int ctxbench(int, char **);
+int fairbench(int, char **);
+int spinbench(int, char **);
+int forkbench(int, char **);
+
 /* filesystem tests */
 int fstest(int, char **);
 int readstress(int, char **);
@@ -41,6 +41,7 @@
 
 struct addrspace;
 struct cpu;
+struct lock;
 struct vnode;
 
 /* get machine-dependent defs */
@@ -64,6 +65,16 @@ typedef enum {
 	S_ZOMBIE,	/* zombie; exited but not yet deleted */
 } threadstate_t;
 
+/* t_donated when no priority has been lent; worse than any real one. */
+#define PRIORITY_NONE (PRIORITY_MAX + 1)
+
+/* The priority a thread is queued at, counting any it has been lent. */
+#define THREAD_PRIORITY(t) \
+	((t)->t_donated < (t)->t_priority ? (t)->t_donated : (t)->t_priority)
+
+/* Size of the in-line buffer for short thread names. */
+#define THREAD_NAMEBUF 24
+
 /* Thread structure. */
 struct thread {
 	/*
@@ -71,9 +82,11 @@ struct thread {
 	 * debugger is messed up.
 	 */
 	char *t_name;			/* Name of this thread */
+	char t_namebuf[THREAD_NAMEBUF];	/* t_name, if it's short enough */
 	const char *t_wchan_name;	/* Name of wait channel, if sleeping */
 	threadstate_t t_state;		/* State this thread is in */
     struct process *t_proc; /* Process associated to this thread */
+    int t_tid;              /* Its user thread ID in t_proc */
 
 	/*
 	 * Thread subsystem internal fields.
@@ -100,6 +113,46 @@ struct thread {
      */
     unsigned t_priority;
     unsigned t_ntimeslices;
+    
+    /*
+     * Priority inheritance. A thread that sleeps waiting for a lock
+     * lends its priority to the holder, and on down the chain if
+     * the holder is itself waiting for a lock, until the lock is
+     * released. t_donated is the best priority lent to this thread
+     * (PRIORITY_NONE if none), and the thread is queued at the
+     * better of it and t_priority (see THREAD_PRIORITY). The time
+     * slice length still comes from t_priority. t_heldlocks lists
+     * the locks the thread holds, linked through lk_nextheld, and
+     * t_waitlock is the lock it is asleep waiting for, if any.
+     * t_donated and t_waitlock are protected by the lock code's
+     * priority inheritance spinlock.
+     */
+    unsigned t_donated;
+    struct lock *t_heldlocks;
+    struct lock *t_waitlock;
+    
+    /*
+     * t_affinity has bit N set if the thread may run on cpu N.
+     * Within that mask, affinity is soft: a woken thread goes back
+     * to the cpu it last ran on (t_cpu), where its TLB and ASID
+     * state are still warm, unless that cpu is overloaded.
+     * t_lastwaker is the cpu that last woke the thread, used to
+     * spot producer/consumer pairs.
+     */
+    uint32_t t_affinity;
+    int t_lastwaker;
+    
+    /*
+     * Fair-share scheduling (options fairshare). t_vruntime is the
+     * cpu time the thread has used, in hardclocks scaled by
+     * FS_WEIGHT_DEFAULT / t_weight, so heavier threads age more
+     * slowly. Each run queue is kept in t_vruntime order and the
+     * thread furthest behind runs next. The value only means
+     * something relative to the cpu's c_minvruntime, so it is
+     * rebased when the thread moves between cpus.
+     */
+    uint64_t t_vruntime;
+    unsigned t_weight;
 
 	/*
 	 * Interrupt state fields.
@@ -162,6 +215,13 @@ int thread_fork(const char *name,
  */
 void thread_exit(void);
 
+/*
+ * Exited threads are kept per CPU, with their stacks, for thread_fork
+ * to reuse. Set the most each CPU keeps (0 to not keep any); returns
+ * the previous limit.
+ */
+unsigned thread_setcachelimit(unsigned limit);
+
 /*
  * Cause the current thread to yield to the next runnable thread, but
  * itself stay runnable.
@@ -180,5 +240,51 @@ void schedule(void);
  */
 void thread_consider_migration(void);
 
+/*
+ * Restrict the current thread to the CPUs in MASK (bit N for cpu N).
+ * Bits for nonexistent CPUs are ignored; returns EINVAL if none are
+ * left. If the current CPU is excluded, the thread moves to an
+ * allowed one before this returns.
+ */
+int thread_setaffinity(uint32_t mask);
+
+/*
+ * Set the priority lent to T by threads waiting for locks it holds,
+ * moving T within its run queue if it is waiting on one. For the
+ * lock code, which calls it holding its priority inheritance lock.
+ */
+void thread_setdonated(struct thread *t, unsigned prio);
+
+/*
+ * Number of CPUs running.
+ */
+unsigned thread_numcpus(void);
+
+/*
+ * Print per-CPU scheduler statistics.
+ */
+void thread_printstats(void);
+
+/*
+ * Fair-share scheduling weights. A thread's share of its cpu is its
+ * weight over the total weight of the runnable threads there.
+ */
+#define FS_WEIGHT_MIN		1
+#define FS_WEIGHT_DEFAULT	1024
+#define FS_WEIGHT_MAX		(64 * FS_WEIGHT_DEFAULT)
+
+/*
+ * Set the current thread's fair-share weight. Returns EINVAL if
+ * WEIGHT is out of range. Has no effect on the other schedulers.
+ */
+int thread_setweight(unsigned weight);
+
+/*
+ * Charge the current thread for a clock tick under the fair-share
+ * scheduler, and preempt it if it has had more than its share.
+ * Called from the timer interrupt.
+ */
+void thread_fairshare_tick(void);
+
 
 #endif /* _THREAD_H_ */
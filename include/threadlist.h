@@ -50,22 +50,38 @@ struct thread;	/* from <thread.h> */
  *    (struct thread *)((char *)node - offsetof(struct thread, t_listnode))
  *
  * to get the thread pointer. But that's gross.
+ *
+ * ->tln_list and ->tln_queue say which list, and which of its queues,
+ * the node is on, so a thread can be taken out of the middle of a
+ * list even if its priority has changed since it was put there.
+ * tln_list is NULL when the node is on no list.
  */
 
+struct threadlist;
+
 struct threadlistnode {
 	struct threadlistnode *tln_prev;
 	struct threadlistnode *tln_next;
 	struct thread *tln_self;
+	struct threadlist *tln_list;
+	int tln_queue;
 };
 
 // tl_head and tl_tail are now an array of pointers to 
 // different FIFO queues
+// Bit i of tl_bitmap is set iff queue i is nonempty, so the best
+// nonempty queue is found with a single find-first-set.
+#if PRIORITY_MAX + 1 > 32
+#error "threadlist bitmap holds at most 32 priorities"
+#endif
+
 struct threadlist {
 	struct threadlistnode tl_head[PRIORITY_MAX + 1];
 	struct threadlistnode tl_tail[PRIORITY_MAX + 1];
 	unsigned tl_count;
     int tl_nprior; // number of priorities in queue
     int tl_nperqueue[PRIORITY_MAX + 1];
+    uint32_t tl_bitmap; // nonempty queues
 };
 
 /* Initialize and clean up a thread list node. */
@@ -87,14 +103,18 @@ struct thread *threadlist_remtail(struct threadlist *tl);
 
 void threadlist_shuffle(struct threadlist *tl);
 
+/* Fair-share run queue: add in t_vruntime order; look at the head */
+void threadlist_addsorted(struct threadlist *tl, struct thread *t);
+struct thread *threadlist_peekhead(struct threadlist *tl);
+
 /* Add and remove: in middle. (TL is needed to maintain ->tl_count.) */
 /*
 void threadlist_insertafter(struct threadlist *tl,
 			    struct thread *onlist, struct thread *addee);
 void threadlist_insertbefore(struct threadlist *tl,
 			     struct thread *addee, struct thread *onlist);
-void threadlist_remove(struct threadlist *tl, struct thread *t);
 */
+void threadlist_remove(struct threadlist *tl, struct thread *t);
 
 /* Iteration; itervar should previously be declared as (struct thread *) */
 #define THREADLIST_FORALL(itervar, tl) \
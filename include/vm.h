@@ -53,16 +53,28 @@ void vm_bootstrap(void);
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
 /* Page fault handling functions called by vm_fault()
+ * Frames brought in are charged to AS
  */
-int vm_unmapped_page_fault(vaddr_t faultaddress, struct page_table *pt);
-int vm_swapin_page_fault(vaddr_t faultaddress, struct pt_entry *pte);
-int vm_copyonwrite_fault(vaddr_t faultaddress, struct page_table *pt);
+struct addrspace;
+int vm_unmapped_page_fault(vaddr_t faultaddress, struct addrspace *as);
+int vm_swapin_page_fault(vaddr_t faultaddress, struct pt_entry *pte,
+                         struct addrspace *as);
+int vm_copyonwrite_fault(vaddr_t faultaddress, struct addrspace *as);
 
 /* Allocate/free kernel heap pages (called by kmalloc/kfree) 
  * alloc_kpages() currently only allows allocation of single
  * pages.
+ *
+ * alloc_kpages_flags() is the same, but takes KALLOC_* flags:
+ *   KALLOC_EAGER - back multi-page allocations with physical memory
+ *                  up front rather than on first touch, so that
+ *                  latency-sensitive users never take a kernel page
+ *                  fault on them.
  */
+#define KALLOC_EAGER 0x1
+
 vaddr_t alloc_kpages(int npages);
+vaddr_t alloc_kpages_flags(int npages, int flags);
 void free_kpages(vaddr_t addr);
 
 /* TLB shootdown handling called from interprocessor_interrupt */
@@ -34,51 +34,86 @@
 #include <cdefs.h>
 #include <kern/vmstat.h>
 #include <spinlock.h>
+#include <platform/maxcpus.h>
 
 // inline to reduce overhead
 #ifndef VMSTAT_INLINE
 #define VMSTAT_INLINE INLINE
 #endif
 
-// global record of VM statistics
-struct vmstat vs_global;
+/*
+ * Per-CPU VM statistics counters.
+ *
+ * Each counter keeps a folded global value plus one slot per CPU.
+ * Updates only touch the current CPU's slot, with interrupts off so
+ * that the thread cannot be preempted or migrated mid-update; no lock
+ * is taken.  Once a slot drifts VS_BATCH away from zero it is folded
+ * into the global value under vc_lock.
+ *
+ * vs_get_* sums the global value and every slot.  It is used when
+ * an accurate value is wanted (e.g., sys_vmstat).
+ *
+ * vs_approx_* reads only the global value.  It may be off by up to
+ * VS_BATCH per CPU, which is fine for threshold checks such as the
+ * cleaner's MAX_DIRTY/MIN_DIRTY.
+ */
+#define VS_BATCH 8
 
-// atomic increment and decrement functions
+struct vs_counter {
+    struct spinlock vc_lock;            // protects folding into vc_global
+    volatile long   vc_global;          // folded value
+    volatile int    vc_cpu[MAXCPUS];    // unfolded per-CPU changes
+};
+
+void   vs_counter_add(struct vs_counter *vc, int delta);
+size_t vs_counter_sum(struct vs_counter *vc);
+size_t vs_counter_approx(struct vs_counter *vc);
+
+// increment, decrement, and read functions
 
 #define VS_DECL(STAT) \
-    VMSTAT_INLINE void vs_incr_##STAT(void);    \
-    VMSTAT_INLINE void vs_decr_##STAT(void);    \
-    VMSTAT_INLINE size_t vs_get_##STAT(void);
+    extern struct vs_counter vs_##STAT;             \
+    VMSTAT_INLINE void vs_incr_##STAT(void);        \
+    VMSTAT_INLINE void vs_decr_##STAT(void);        \
+    VMSTAT_INLINE size_t vs_get_##STAT(void);       \
+    VMSTAT_INLINE size_t vs_approx_##STAT(void);
 
 #define VS_IMPL(STAT) \
-struct spinlock vs_##STAT##_lock = SPINLOCK_INITIALIZER; \
-                                                \
-    VMSTAT_INLINE void                          \
-    vs_incr_##STAT(void) {                      \
-        spinlock_acquire(&vs_##STAT##_lock);    \
-        vs_global.vs_##STAT++;                  \
-        spinlock_release(&vs_##STAT##_lock);    \
-    }                                           \
-                                                \
-    VMSTAT_INLINE void                          \
-    vs_decr_##STAT(void) {                      \
-        spinlock_acquire(&vs_##STAT##_lock);    \
-        vs_global.vs_##STAT--;                  \
-        spinlock_release(&vs_##STAT##_lock);    \
-    }                                           \
-                                                \
-    VMSTAT_INLINE size_t                        \
-    vs_get_##STAT(void) {                       \
-        spinlock_acquire(&vs_##STAT##_lock);    \
-        size_t ret = vs_global.vs_##STAT;       \
-        spinlock_release(&vs_##STAT##_lock);    \
-        return ret;                             \
+struct vs_counter vs_##STAT = { SPINLOCK_INITIALIZER, 0, { 0 } }; \
+                                                    \
+    VMSTAT_INLINE void                              \
+    vs_incr_##STAT(void) {                          \
+        vs_counter_add(&vs_##STAT, 1);              \
+    }                                               \
+                                                    \
+    VMSTAT_INLINE void                              \
+    vs_decr_##STAT(void) {                          \
+        vs_counter_add(&vs_##STAT, -1);             \
+    }                                               \
+                                                    \
+    VMSTAT_INLINE size_t                            \
+    vs_get_##STAT(void) {                           \
+        return vs_counter_sum(&vs_##STAT);          \
+    }                                               \
+                                                    \
+    VMSTAT_INLINE size_t                            \
+    vs_approx_##STAT(void) {                        \
+        return vs_counter_approx(&vs_##STAT);       \
     }
 
 
 void vs_init_ram(size_t npages, size_t nwired);
 void vs_init_swap(size_t npages);
 
+// fill in a snapshot of all statistics (for sys_vmstat)
+void vs_snapshot(struct vmstat *vs);
+
+// Fault latency histograms (per-CPU, summed when read)
+// vs_record_fault - count a fault of type VS_FAULT_* taking ncycles
+// vs_print_faults - print the histograms to the console
+void vs_record_fault(int type, uint32_t ncycles);
+void vs_print_faults(void);
+
 // Physical memory statistics
 VS_DECL(ram_free);
 VS_DECL(ram_active);
@@ -94,5 +129,6 @@ VS_DECL(swap_outs);
 // VM system statistics
 VS_DECL(faults);
 VS_DECL(cow_faults);
+VS_DECL(reclaim_waits);
 
 #endif /* _VMSTAT_H_ */
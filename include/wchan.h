@@ -81,5 +81,16 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Move one thread, or all threads, sleeping on FROM to sleep on TO
+ * instead, without waking them; they will be woken by a wakeup on TO.
+ * Neither queue should already be locked. Returns the number moved.
+ *
+ * Both channels are locked at once, FROM first, so callers must
+ * always move between any two channels in the same direction.
+ */
+unsigned wchan_moveone(struct wchan *from, struct wchan *to);
+unsigned wchan_moveall(struct wchan *from, struct wchan *to);
+
 
 #endif /* _WCHAN_H_ */
@@ -0,0 +1,90 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Deferred work: run a function later, in thread context, on a
+ * per-cpu worker thread.
+ *
+ * Each cpu has a worker thread, pinned to it, and a queue per
+ * priority; the worker runs everything queued at WORK_HIGH before
+ * anything at WORK_LOW, each queue in FIFO order. Work functions may
+ * sleep, but everything behind them on that cpu waits meanwhile, so
+ * long waits belong in a thread of their own.
+ *
+ * Queueing a work item that is already queued does nothing (the two
+ * requests coalesce into one run), so it is cheap to queue something
+ * whenever there might be work for it. An item is taken off the
+ * queue just before its function is called, so queueing it while the
+ * function runs causes another run, possibly on another cpu at the
+ * same time; the function must do its own locking.
+ *
+ * Items may be queued from interrupt handlers. An item must not be
+ * freed or reinitialized while it's queued.
+ *
+ * The structure is public so work items can be embedded in other
+ * structures; use the functions below on it.
+ */
+
+#include <spinlock.h>
+
+/* Priorities */
+#define WORK_HIGH	0	/* ahead of everything else */
+#define WORK_LOW	1	/* background work */
+#define WORK_NPRIO	2
+
+struct work {
+	struct work *wk_next;		/* queue link */
+	volatile spinlock_data_t wk_queued;	/* 1 while queued */
+	unsigned wk_prio;		/* WORK_HIGH or WORK_LOW */
+	void (*wk_func)(void *);	/* what to call */
+	void *wk_arg;			/* ... and its argument */
+};
+
+/*
+ * Functions:
+ *
+ * work_init		Set up WK to call FUNC(ARG) at priority PRIO.
+ * work_queue		Queue WK on the current cpu. Returns false if it
+ *			was already queued (anywhere).
+ * work_queue_on	Same, but on cpu number CPU.
+ * work_pending		True if WK is queued and hasn't started running.
+ */
+void work_init(struct work *wk, void (*func)(void *), void *arg,
+	       unsigned prio);
+bool work_queue(struct work *wk);
+bool work_queue_on(struct work *wk, unsigned cpu);
+bool work_pending(struct work *wk);
+
+/* Call once during system startup, after the other cpus are started. */
+void workqueue_bootstrap(void);
+
+#endif /* _WORKQUEUE_H_ */
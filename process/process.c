@@ -28,21 +28,39 @@
  */
 
 #include <limits.h>
+#include <kern/errno.h>
+#include <kern/wait.h>
 #include <process.h>
 #include <current.h>
 #include <cpu.h>
 #include <spl.h>
 #include <lib.h>
 #include <pid_set.h>
+#include <workqueue.h>
+#include <futex.h>
+#include <platform/maxcpus.h>
 
 struct process *pid_table[PID_MAX + 1];
 struct rw_mutex *pidt_rw;
 pid_t pid_next = PID_MIN;
 
+// Orphans are reaped by a work item per cpu (see process_reap_orphans)
+static struct work process_reapers[MAXCPUS];
+static volatile spinlock_data_t process_nexits; // # of processes exited
+static unsigned process_reapgen[MAXCPUS]; // process_nexits at last reap
+
+static void process_reap(void *unused);
+
 void
 process_bootstrap(void)
 {
     pidt_rw = rw_create("Process Table");
+    
+    for (unsigned i = 0; i < MAXCPUS; i++) {
+        work_init(&process_reapers[i], process_reap, NULL, WORK_HIGH);
+        process_reapgen[i] = 0;
+    }
+    spinlock_data_set(&process_nexits, 0);
 }
 
 void
@@ -78,12 +96,21 @@ process_create(char *name)
     
     // zero all pointers so that fork() can properly
     // unwind if some structures have been set up
-    p->ps_thread = NULL;
     p->ps_fdt = NULL;
     p->ps_addrspace = NULL;
     p->ps_children = NULL;
     p->ps_waitpid_cv = NULL;
-    p->ps_waitpid_lock = NULL;
+    p->ps_thread_cv = NULL;
+    p->ps_lock = NULL;
+    
+    // no threads until the creator reserves one
+    for (int i = 0; i < PROC_MAXTHREADS; i++) {
+        p->ps_threads[i].ut_status = TS_FREE;
+        p->ps_threads[i].ut_thread = NULL;
+        p->ps_threads[i].ut_waiton = NULL;
+    }
+    p->ps_nthreads = 0;
+    p->ps_exiting = false;
     
     p->ps_children = pid_set_create();
     if (p->ps_children == NULL)
@@ -93,8 +120,8 @@ process_create(char *name)
         return NULL;
     }
     
-    p->ps_waitpid_lock = lock_create("waitpid");
-    if (p->ps_waitpid_lock == NULL)
+    p->ps_lock = lock_create("process");
+    if (p->ps_lock == NULL)
     {
         pid_set_destroy(p->ps_children);
         kfree(p->ps_name);
@@ -105,7 +132,18 @@ process_create(char *name)
     p->ps_waitpid_cv = cv_create("waitpid");
     if (p->ps_waitpid_cv == NULL)
     {
-        lock_destroy(p->ps_waitpid_lock);
+        lock_destroy(p->ps_lock);
+        pid_set_destroy(p->ps_children);
+        kfree(p->ps_name);
+        kfree(p);
+        return NULL;
+    }
+    
+    p->ps_thread_cv = cv_create("thread");
+    if (p->ps_thread_cv == NULL)
+    {
+        cv_destroy(p->ps_waitpid_cv);
+        lock_destroy(p->ps_lock);
         pid_set_destroy(p->ps_children);
         kfree(p->ps_name);
         kfree(p);
@@ -122,11 +160,49 @@ process_create(char *name)
 }
 
 
+// Wait for the process's other threads to leave. Call with ps_lock
+// held and ps_exiting set.
+static
+void
+process_waitothers(struct process *p)
+{
+    KASSERT(p->ps_exiting);
+    
+    // wake any in thread_join(), futex(), waitpid() or a console
+    // read so they can go
+    cv_broadcast(p->ps_thread_cv, p->ps_lock);
+    futex_interrupt(p->ps_addrspace);
+    for (int i = 0; i < PROC_MAXTHREADS; i++) {
+        struct process *child = p->ps_threads[i].ut_waiton;
+        if (child != NULL) {
+            // it can't be destroyed until the waiter is done with it,
+            // which takes our ps_lock
+            lock_acquire(child->ps_lock);
+            cv_broadcast(child->ps_waitpid_cv, child->ps_lock);
+            lock_release(child->ps_lock);
+        }
+    }
+    getch_interrupt();
+    while (p->ps_nthreads > 1)
+        cv_wait(p->ps_thread_cv, p->ps_lock);
+}
+
 void
 process_finish(struct process *p, int code)
 {
-    // should only be called from the process' thread
+    // should only be called from one of the process' threads
     KASSERT(p == curthread->t_proc);
+    
+    // Stop the other threads. If one of them got here first, it
+    // sets the exit code and we just go.
+    lock_acquire(p->ps_lock);
+    if (p->ps_exiting) {
+        lock_release(p->ps_lock);
+        process_thread_leave();
+    }
+    p->ps_exiting = true;
+    process_waitothers(p);
+    lock_release(p->ps_lock);
 
     // orphan all children
     if (!pid_set_empty(p->ps_children))
@@ -138,7 +214,7 @@ process_finish(struct process *p, int code)
         splx(x);
     }
     
-    lock_acquire(p->ps_waitpid_lock);
+    lock_acquire(p->ps_lock);
     p->ps_status = PS_ZOMBIE;
     p->ps_exit_code = code;
     
@@ -147,23 +223,37 @@ process_finish(struct process *p, int code)
     // NOTE: the parent process (or the kernel menu if
     // the process was started from the menu)
     // is responsible for freeing p
+    KASSERT(p->ps_nthreads == 1);
+    p->ps_threads[curthread->t_tid].ut_status = TS_FREE;
+    p->ps_threads[curthread->t_tid].ut_thread = NULL;
+    p->ps_nthreads = 0;
     curthread->t_proc = NULL;
-    p->ps_thread = NULL;
     
-    cv_signal(p->ps_waitpid_cv, p->ps_waitpid_lock);
-    lock_release(p->ps_waitpid_lock);
+    cv_signal(p->ps_waitpid_cv, p->ps_lock);
+    lock_release(p->ps_lock);
+    
+    // if p is somebody's orphan, it can be reaped now
+    spinlock_data_fetchadd(&process_nexits, 1);
 }
 
 // Wait on a process.  For use in waitpid()
+// A user thread gives up if its own process starts exiting (see
+// process_waitothers), so it must have set its ut_waiton to P first.
 int
 process_waiton(struct process *p)
 {
+    struct process *self = curthread->t_proc;
     int exit_code;
-    lock_acquire(p->ps_waitpid_lock);
-    while (p->ps_status != PS_ZOMBIE)
-        cv_wait(p->ps_waitpid_cv, p->ps_waitpid_lock);
+    lock_acquire(p->ps_lock);
+    while (p->ps_status != PS_ZOMBIE) {
+        if (self != NULL && self->ps_exiting) {
+            lock_release(p->ps_lock);
+            return -1;
+        }
+        cv_wait(p->ps_waitpid_cv, p->ps_lock);
+    }
     exit_code = p->ps_exit_code;
-    lock_release(p->ps_waitpid_lock);
+    lock_release(p->ps_lock);
     return exit_code;
 }
 
@@ -172,10 +262,10 @@ int
 process_checkon(struct process *p)
 {
     int exit_code = -1;
-    lock_acquire(p->ps_waitpid_lock);
+    lock_acquire(p->ps_lock);
     if (p->ps_status == PS_ZOMBIE)
         exit_code = p->ps_exit_code;
-    lock_release(p->ps_waitpid_lock);
+    lock_release(p->ps_lock);
     return exit_code;
 }
 
@@ -222,7 +312,7 @@ process_destroy(pid_t pid)
     rw_wlock(pidt_rw);
     struct process *p = pid_table[pid];
     
-    KASSERT(p->ps_thread == NULL);
+    KASSERT(p->ps_nthreads == 0);
     
     pid_table[pid] = NULL;
     rw_wdone(pidt_rw);
@@ -255,12 +345,15 @@ process_cleanup(struct process *p)
     if (p->ps_children)
         pid_set_destroy(p->ps_children);
     
-    if (p->ps_waitpid_lock)
-        lock_destroy(p->ps_waitpid_lock);
+    if (p->ps_lock)
+        lock_destroy(p->ps_lock);
     
     if (p->ps_waitpid_cv)
         cv_destroy(p->ps_waitpid_cv);
     
+    if (p->ps_thread_cv)
+        cv_destroy(p->ps_thread_cv);
+    
     kfree(p);
 }
 
@@ -281,6 +374,54 @@ process_orphan(pid_t pid)
     return true;
 }
 
+/*
+ * Reap this cpu's exited orphans, in thread context on its worker.
+ * The orphan set is swapped for an empty one at splhigh, so orphans
+ * can be added while we sleep in process_destroy; those still running
+ * are put back afterwards.
+ */
+static
+void
+process_reap(void *unused)
+{
+    (void)unused;
+    
+    struct pid_set *orphans, *fresh;
+    
+    fresh = pid_set_create();
+    if (fresh == NULL)
+        return; // try again after the next exit
+    
+    int x = splhigh();
+    process_reapgen[curcpu->c_number] = spinlock_data_get(&process_nexits);
+    orphans = curcpu->c_orphans;
+    curcpu->c_orphans = fresh;
+    splx(x);
+    
+    pid_set_map(orphans, process_check_destroy);
+    
+    x = splhigh();
+    pid_set_map(orphans, process_orphan);
+    splx(x);
+    pid_set_destroy(orphans);
+}
+
+/*
+ * Called from exorcise(), at splhigh. Destroying processes takes
+ * sleep locks and tears down address spaces, which mustn't happen in
+ * the middle of a thread switch, so hand it to this cpu's worker if
+ * the cpu has orphans and any process has exited since it last looked.
+ */
+void
+process_reap_orphans(void)
+{
+    unsigned cpu = curcpu->c_number;
+    
+    if (!pid_set_empty(curcpu->c_orphans)
+        && process_reapgen[cpu] != spinlock_data_get(&process_nexits))
+        work_queue_on(&process_reapers[cpu], cpu);
+}
+
 bool
 process_check_destroy(pid_t pid)
 {
@@ -294,3 +435,220 @@ process_check_destroy(pid_t pid)
     // during pid_set_map()
     return true;
 }
+
+////////////////////////////////////////////////////////////
+// User threads
+
+void
+process_thread_reserve(struct process *p, int tid)
+{
+    KASSERT(tid >= 0 && tid < PROC_MAXTHREADS);
+    
+    lock_acquire(p->ps_lock);
+    KASSERT(p->ps_threads[tid].ut_status == TS_FREE);
+    p->ps_threads[tid].ut_status = TS_ACTIVE;
+    p->ps_threads[tid].ut_thread = NULL;
+    p->ps_nthreads++;
+    lock_release(p->ps_lock);
+}
+
+int
+process_thread_alloc(struct process *p, vaddr_t entry, vaddr_t arg,
+                     int *tid)
+{
+    vaddr_t stackptr;
+    int i, err;
+    
+    lock_acquire(p->ps_lock);
+    if (p->ps_exiting) {
+        lock_release(p->ps_lock);
+        return EINTR;
+    }
+    
+    for (i = 0; i < PROC_MAXTHREADS; i++) {
+        if (p->ps_threads[i].ut_status == TS_FREE)
+            break;
+    }
+    if (i == PROC_MAXTHREADS) {
+        lock_release(p->ps_lock);
+        return EAGAIN;
+    }
+    
+    // the stack goes with the ID, so an ID's stack is reused with it
+    err = as_define_threadstack(p->ps_addrspace, i, &stackptr);
+    if (err) {
+        lock_release(p->ps_lock);
+        return err;
+    }
+    
+    p->ps_threads[i].ut_status = TS_ACTIVE;
+    p->ps_threads[i].ut_thread = NULL;
+    p->ps_threads[i].ut_exitval = 0;
+    p->ps_threads[i].ut_entry = entry;
+    p->ps_threads[i].ut_arg = arg;
+    p->ps_threads[i].ut_stack = stackptr;
+    p->ps_nthreads++;
+    lock_release(p->ps_lock);
+    
+    *tid = i;
+    return 0;
+}
+
+// For the new thread itself, before it goes to user mode
+void
+process_thread_attach(struct process *p, int tid)
+{
+    bool exiting;
+    
+    curthread->t_proc = p;
+    curthread->t_tid = tid;
+    
+    lock_acquire(p->ps_lock);
+    KASSERT(p->ps_threads[tid].ut_status == TS_ACTIVE);
+    KASSERT(p->ps_threads[tid].ut_thread == NULL);
+    p->ps_threads[tid].ut_thread = curthread;
+    exiting = p->ps_exiting;
+    lock_release(p->ps_lock);
+    
+    if (exiting)
+        process_thread_leave();
+}
+
+// If the kernel thread for a reserved ID couldn't be started
+void
+process_thread_unreserve(struct process *p, int tid)
+{
+    lock_acquire(p->ps_lock);
+    KASSERT(p->ps_threads[tid].ut_status == TS_ACTIVE);
+    KASSERT(p->ps_threads[tid].ut_thread == NULL);
+    p->ps_threads[tid].ut_status = TS_FREE;
+    p->ps_nthreads--;
+    // process_waitothers() may be counting on it
+    cv_broadcast(p->ps_thread_cv, p->ps_lock);
+    lock_release(p->ps_lock);
+}
+
+int
+process_thread_join(struct process *p, int tid, int *exitval)
+{
+    int err;
+    
+    if (tid < 0 || tid >= PROC_MAXTHREADS)
+        return ESRCH;
+    if (tid == curthread->t_tid)
+        return EINVAL;
+    
+    struct uthread *ut = &p->ps_threads[tid];
+    
+    lock_acquire(p->ps_lock);
+    while (ut->ut_status == TS_ACTIVE && !p->ps_exiting)
+        cv_wait(p->ps_thread_cv, p->ps_lock);
+    
+    if (p->ps_exiting) {
+        // on the way out; see process_finish()
+        err = EINTR;
+    }
+    else if (ut->ut_status != TS_ZOMBIE) {
+        // never created, or somebody else joined it
+        err = ESRCH;
+    }
+    else {
+        *exitval = ut->ut_exitval;
+        ut->ut_status = TS_FREE;
+        err = 0;
+    }
+    lock_release(p->ps_lock);
+    return err;
+}
+
+// Take the current thread out of its process, leaving its ID in
+// state STATUS, and exit.
+static
+void
+process_thread_detach(struct process *p, tstat_t status)
+{
+    struct uthread *ut = &p->ps_threads[curthread->t_tid];
+    
+    KASSERT(lock_do_i_hold(p->ps_lock));
+    KASSERT(ut->ut_thread == curthread);
+    
+    ut->ut_status = status;
+    ut->ut_thread = NULL;
+    p->ps_nthreads--;
+    curthread->t_proc = NULL;
+    
+    // for joiners, and process_waitothers()
+    cv_broadcast(p->ps_thread_cv, p->ps_lock);
+    lock_release(p->ps_lock);
+    
+    thread_exit();
+}
+
+void
+process_thread_exit(int exitval)
+{
+    struct process *p = curthread->t_proc;
+    
+    lock_acquire(p->ps_lock);
+    if (p->ps_nthreads == 1 && !p->ps_exiting) {
+        // last one out: the process exits normally
+        lock_release(p->ps_lock);
+        process_finish(p, _MKWAIT_EXIT(0));
+        thread_exit();
+    }
+    
+    p->ps_threads[curthread->t_tid].ut_exitval = exitval;
+    process_thread_detach(p, TS_ZOMBIE);
+}
+
+void
+process_thread_leave(void)
+{
+    struct process *p = curthread->t_proc;
+    
+    lock_acquire(p->ps_lock);
+    KASSERT(p->ps_exiting);
+    // nobody will join a thread that was made to leave
+    process_thread_detach(p, TS_FREE);
+}
+
+int
+process_single(struct process *p)
+{
+    lock_acquire(p->ps_lock);
+    if (p->ps_exiting) {
+        lock_release(p->ps_lock);
+        return EINTR;
+    }
+    
+    if (p->ps_nthreads > 1) {
+        p->ps_exiting = true;
+        process_waitothers(p);
+        p->ps_exiting = false;
+    }
+    
+    // exited threads can't be joined any more either
+    for (int i = 0; i < PROC_MAXTHREADS; i++) {
+        if (i != curthread->t_tid)
+            p->ps_threads[i].ut_status = TS_FREE;
+    }
+    lock_release(p->ps_lock);
+    return 0;
+}
+
+// After a successful execv, the thread runs on the main stack
+void
+process_thread_main(struct process *p)
+{
+    int tid = curthread->t_tid;
+    
+    lock_acquire(p->ps_lock);
+    KASSERT(p->ps_nthreads == 1);
+    if (tid != 0) {
+        p->ps_threads[0] = p->ps_threads[tid];
+        p->ps_threads[tid].ut_status = TS_FREE;
+        p->ps_threads[tid].ut_thread = NULL;
+        curthread->t_tid = 0;
+    }
+    lock_release(p->ps_lock);
+}
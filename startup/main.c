@@ -41,6 +41,8 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <workqueue.h>
+#include <futex.h>
 #include <vm.h>
 #include <coremem.h>
 #include <mainbus.h>
@@ -122,12 +124,16 @@ boot(void)
 	/* Now do pseudo-devices. */
 	pseudoconfig();
 	kprintf("\n");
+	/* With the clock attached, idle cpus can stop ticking. */
+	hardclock_tickless_bootstrap();
 
 	/* Late phase of initialization. */
 	kprintf_bootstrap();
 	thread_start_cpus();
+	workqueue_bootstrap();
 	vm_bootstrap();
     process_bootstrap();
+	futex_bootstrap();
 
 	/* Buffer cache */
 	buffer_bootstrap();
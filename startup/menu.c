@@ -43,9 +43,13 @@
 #include <syscall.h>
 #include <test.h>
 #include <buf.h>
+#include <vmstat.h>
+#include <lockstat.h>
 #include "opt-synchprobs.h"
+#include "opt-dumbvm.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockstat.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -365,6 +369,46 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_schedstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_printstats();
+
+	return 0;
+}
+
+#if OPT_LOCKSTAT
+static
+int
+cmd_lockstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	lockstat_print();
+
+	return 0;
+}
+#endif
+
+#if !OPT_DUMBVM
+static
+int
+cmd_vmfaultstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vs_print_faults();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -436,6 +480,10 @@ static const char *testmenu[] = {
 	"[sy2] Lock test             (1)     ",
 	"[sy3] CV test               (1)     ",
 	"[sy4] Fair lock test     (unit)     ",
+	"[cs]  Context switch benchmark      ",
+	"[fair] Fair-share benchmark         ",
+	"[sl]  Spinlock benchmark            ",
+	"[fb]  Fork/exit benchmark           ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress        (4)     ",
 	"[fs3] FS write stress       (4)     ",
@@ -470,6 +518,13 @@ static const char *mainmenu[] = {
 	"[pz] Piazza                         ",
 #endif
 	"[kh] Kernel heap stats              ",
+	"[ss] Scheduler stats                ",
+#if OPT_LOCKSTAT
+	"[lk] Lock contention stats          ",
+#endif
+#if !OPT_DUMBVM
+	"[vf] VM fault latency stats         ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -525,6 +580,13 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "ss",         cmd_schedstats },
+#if OPT_LOCKSTAT
+	{ "lk",         cmd_lockstats },
+#endif
+#if !OPT_DUMBVM
+	{ "vf",         cmd_vmfaultstats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -544,6 +606,12 @@ static struct {
 	{ "sy3",	cvtest },
 	{ "sy4",  fairlocktest },
 
+	/* scheduler benchmarks */
+	{ "cs",		ctxbench },
+	{ "fair",	fairbench },
+	{ "sl",		spinbench },
+	{ "fb",		forkbench },
+
 	/* file system assignment tests */
 	{ "fs1",	fstest },
 	{ "fs2",	readstress },
@@ -49,6 +49,11 @@ sys_execv(const_userptr_t path, const_userptr_t argv)
     int err;
     struct process *proc = curthread->t_proc;
     
+    // The other threads go first, as they use the address space we
+    // replace. (If exec then fails, they are gone all the same.)
+    if ((err = process_single(proc)))
+        return err;
+    
     char *kpath = kmalloc(PATH_MAX);
     if (kpath == NULL)
         return ENOMEM;
@@ -107,6 +112,10 @@ sys_execv(const_userptr_t path, const_userptr_t argv)
         proc->ps_name = old_name;
         return ENOMEM;
     }
+#if !OPT_DUMBVM
+    // the resident limit survives exec
+    as->as_rss_limit = old_as->as_rss_limit;
+#endif
     proc->ps_addrspace = as;
     
     // Activate the new address space
@@ -159,6 +168,9 @@ sys_execv(const_userptr_t path, const_userptr_t argv)
         return err;
     }
     
+    // we are the new program's main thread, on the main stack
+    process_thread_main(proc);
+    
     // destroy old address space and free memory
     // that we will no longer need
     as_destroy(old_as);
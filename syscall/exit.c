@@ -33,6 +33,7 @@
 #include <pid_set.h>
 #include <process.h>
 #include <current.h>
+#include <spl.h>
 #include <lib.h>
 #include <copyinout.h>
 #include <syscall.h>
@@ -63,8 +64,15 @@ int sys_waitpid(pid_t pid, userptr_t stat_loc, int options, int *err)
     
     struct process *proc = curthread->t_proc;
     struct pid_set *children = proc->ps_children;
+    bool block;
+    
+    // Other threads may be waiting for the same child. Whichever
+    // takes it out of our PID set (under ps_lock) destroys it, and
+    // until then it can't go away.
+    lock_acquire(proc->ps_lock);
     if (!pid_set_includes(children, pid))
     {
+        lock_release(proc->ps_lock);
         *err = ECHILD;
         return -1;
     }
@@ -79,18 +87,48 @@ int sys_waitpid(pid_t pid, userptr_t stat_loc, int options, int *err)
         case WNOHANG:
             exit_code = process_checkon(child);
             if (exit_code == -1)
+            {
+                lock_release(proc->ps_lock);
                 return 0;
+            }
+            block = false;
             break;
         case WUNTRACED:
         case 0:
-            exit_code = process_waiton(child);
+            block = true;
             break;
         default:
+            lock_release(proc->ps_lock);
             *err = EINVAL;
             return -1;
     }
     
     pid_set_remove(children, child->ps_pid);
+    // so that _exit() and execv() can wake us (see process_waitothers)
+    proc->ps_threads[curthread->t_tid].ut_waiton = child;
+    lock_release(proc->ps_lock);
+    
+    if (block)
+        exit_code = process_waiton(child);
+    
+    lock_acquire(proc->ps_lock);
+    proc->ps_threads[curthread->t_tid].ut_waiton = NULL;
+    if (block && exit_code == -1)
+    {
+        // our process is exiting; leave the child to it
+        if (pid_set_add(children, child->ps_pid))
+        {
+            // no room to put it back, so let it be reaped instead
+            int x = splhigh();
+            process_orphan(child->ps_pid);
+            splx(x);
+        }
+        lock_release(proc->ps_lock);
+        *err = EINTR;
+        return -1;
+    }
+    lock_release(proc->ps_lock);
+    
     process_destroy(child->ps_pid);
     
     // try to give the user the exit code
@@ -38,6 +38,16 @@
 // defined in process.c
 void process_cleanup(struct process *p);
 
+// take back a child we failed to start
+static
+void
+fork_unchild(struct process *parent, pid_t child_pid)
+{
+    lock_acquire(parent->ps_lock);
+    pid_set_remove(parent->ps_children, child_pid);
+    lock_release(parent->ps_lock);
+}
+
 pid_t
 sys_fork(const struct trapframe *parent_tf, int *err)
 {
@@ -82,7 +92,9 @@ sys_fork(const struct trapframe *parent_tf, int *err)
     
     // add PID to children now.  That way, if we fail to
     // allocate memory, we have not yet forked a thread
+    lock_acquire(parent->ps_lock);
     *err = pid_set_add(parent->ps_children, child_pid);
+    lock_release(parent->ps_lock);
     if (*err)
     {
         process_destroy(child_pid);
@@ -94,7 +106,7 @@ sys_fork(const struct trapframe *parent_tf, int *err)
     if (child_tf == NULL)
     {
         process_destroy(child_pid);
-        pid_set_remove(parent->ps_children, child_pid);
+        fork_unchild(parent, child_pid);
         *err = ENOMEM;
         return -1;
     }
@@ -108,17 +120,23 @@ sys_fork(const struct trapframe *parent_tf, int *err)
     // as pointers always fit in machine registers
     child_tf->TF_RET = (uintptr_t)child;
     
+    // The child's thread keeps our thread ID, as it runs on the
+    // same user stack in its copy of the address space.
+    int tid = curthread->t_tid;
+    process_thread_reserve(child, tid);
+    
     // child thread sets up child return value
-    // and ps_thread/t_proc
+    // and its t_proc and thread ID
     *err = thread_fork("user process",
                        enter_forked_process,
-                       child_tf, 0,
+                       child_tf, tid,
                        NULL);
     if (*err)
     {
+        process_thread_unreserve(child, tid);
         process_destroy(child_pid);
         kfree(child_tf);
-        pid_set_remove(parent->ps_children, child_pid);
+        fork_unchild(parent, child_pid);
         return -1;
     }
     
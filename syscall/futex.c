@@ -0,0 +1,269 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * futex(): user-level sleep and wakeup on an int in user memory.
+ *
+ * A user lock takes and drops itself with atomic operations in user
+ * space, and comes here only to sleep when it's contended or to wake
+ * sleepers. Sleepers are keyed by (address space, user address) and
+ * hashed into a table of buckets, each with a lock, a wait channel
+ * and a FIFO list of the sleepers. A bucket's wait channel is shared
+ * by all the addresses that hash there, so a wakeup wakes them all
+ * and those not picked go back to sleep; with enough buckets that is
+ * rare.
+ *
+ * There is no user memory shared between address spaces here (forked
+ * pages are copied on write), so the address space and user address
+ * name a futex word exactly.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/futex.h>
+#include <lib.h>
+#include <synch.h>
+#include <wchan.h>
+#include <current.h>
+#include <thread.h>
+#include <process.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <syscall.h>
+#include <futex.h>
+
+#define FUTEX_HASHBITS 6
+#define FUTEX_NBUCKETS (1 << FUTEX_HASHBITS)
+
+/* More sleepers than there can be */
+#define FUTEX_ALL 0x7fffffff
+
+/* A thread asleep in futex(), on its own stack */
+struct futex_waiter {
+	struct addrspace *fw_as;
+	vaddr_t fw_uaddr;
+	int fw_result;			/* -1 while asleep, then the error */
+	struct futex_waiter *fw_next;
+};
+
+struct futex_bucket {
+	struct lock *fb_lock;
+	struct wchan *fb_wchan;
+	struct futex_waiter *fb_head;	/* sleepers, oldest first */
+	struct futex_waiter **fb_tailp;
+};
+
+static struct futex_bucket futex_table[FUTEX_NBUCKETS];
+
+void
+futex_bootstrap(void)
+{
+	struct futex_bucket *fb;
+	unsigned i;
+
+	for (i = 0; i < FUTEX_NBUCKETS; i++) {
+		fb = &futex_table[i];
+		fb->fb_lock = lock_create("futex");
+		fb->fb_wchan = wchan_create("futex");
+		if (fb->fb_lock == NULL || fb->fb_wchan == NULL) {
+			panic("futex_bootstrap: Out of memory\n");
+		}
+		fb->fb_head = NULL;
+		fb->fb_tailp = &fb->fb_head;
+	}
+}
+
+static
+struct futex_bucket *
+futex_bucket(struct addrspace *as, vaddr_t uaddr)
+{
+	uint32_t h;
+
+	/* futex words are aligned, so the low bits carry nothing */
+	h = ((uint32_t)(uintptr_t)as ^ (uint32_t)(uaddr >> 2)) * 2654435761U;
+	return &futex_table[h >> (32 - FUTEX_HASHBITS)];
+}
+
+/*
+ * Take out of FB's list the sleepers that MATCH, up to MAX of them,
+ * and set their result to RESULT. Wakes them if there were any;
+ * returns how many. Call with the bucket locked.
+ */
+static
+int
+futex_unqueue(struct futex_bucket *fb, struct addrspace *as,
+	      bool (*match)(struct futex_waiter *, struct addrspace *,
+			    vaddr_t),
+	      vaddr_t uaddr, int max, int result)
+{
+	struct futex_waiter **fwp, *fw;
+	int n = 0;
+
+	KASSERT(lock_do_i_hold(fb->fb_lock));
+
+	fwp = &fb->fb_head;
+	while ((fw = *fwp) != NULL && n < max) {
+		if (!match(fw, as, uaddr)) {
+			fwp = &fw->fw_next;
+			continue;
+		}
+		*fwp = fw->fw_next;
+		if (fb->fb_tailp == &fw->fw_next) {
+			fb->fb_tailp = fwp;
+		}
+		fw->fw_result = result;
+		n++;
+	}
+	if (n > 0) {
+		wchan_wakeall(fb->fb_wchan);
+	}
+	return n;
+}
+
+static
+bool
+futex_match_word(struct futex_waiter *fw, struct addrspace *as,
+		 vaddr_t uaddr)
+{
+	return fw->fw_as == as && fw->fw_uaddr == uaddr;
+}
+
+static
+bool
+futex_match_as(struct futex_waiter *fw, struct addrspace *as,
+	       vaddr_t uaddr)
+{
+	(void)uaddr;
+	return fw->fw_as == as;
+}
+
+static
+int
+futex_wait(struct process *p, userptr_t uaddr, int val)
+{
+	struct addrspace *as = p->ps_addrspace;
+	struct futex_bucket *fb = futex_bucket(as, (vaddr_t)uaddr);
+	struct futex_waiter fw;
+	int cur, err;
+
+	lock_acquire(fb->fb_lock);
+
+	/* Don't sleep where futex_interrupt has already been. */
+	if (p->ps_exiting) {
+		lock_release(fb->fb_lock);
+		return EINTR;
+	}
+
+	/*
+	 * Look at the word with the bucket locked, so a waker that
+	 * changes it before we look can't then miss us.
+	 */
+	err = copyin(uaddr, &cur, sizeof(int));
+	if (err) {
+		lock_release(fb->fb_lock);
+		return err;
+	}
+	if (cur != val) {
+		lock_release(fb->fb_lock);
+		return EAGAIN;
+	}
+
+	fw.fw_as = as;
+	fw.fw_uaddr = (vaddr_t)uaddr;
+	fw.fw_result = -1;
+	fw.fw_next = NULL;
+	*fb->fb_tailp = &fw;
+	fb->fb_tailp = &fw.fw_next;
+
+	/* Wakeups for other words in the bucket wake us too. */
+	while (fw.fw_result < 0) {
+		wchan_lock(fb->fb_wchan);
+		lock_release(fb->fb_lock);
+		wchan_sleep(fb->fb_wchan);
+		lock_acquire(fb->fb_lock);
+	}
+	lock_release(fb->fb_lock);
+
+	return fw.fw_result;
+}
+
+static
+int
+futex_wake(struct process *p, userptr_t uaddr, int max)
+{
+	struct addrspace *as = p->ps_addrspace;
+	struct futex_bucket *fb = futex_bucket(as, (vaddr_t)uaddr);
+	int n;
+
+	lock_acquire(fb->fb_lock);
+	n = futex_unqueue(fb, as, futex_match_word, (vaddr_t)uaddr, max, 0);
+	lock_release(fb->fb_lock);
+
+	return n;
+}
+
+void
+futex_interrupt(struct addrspace *as)
+{
+	struct futex_bucket *fb;
+	unsigned i;
+
+	for (i = 0; i < FUTEX_NBUCKETS; i++) {
+		fb = &futex_table[i];
+		lock_acquire(fb->fb_lock);
+		futex_unqueue(fb, as, futex_match_as, 0, FUTEX_ALL, EINTR);
+		lock_release(fb->fb_lock);
+	}
+}
+
+int
+sys_futex(userptr_t uaddr, int op, int val, int *err)
+{
+	struct process *proc = curthread->t_proc;
+
+	if ((vaddr_t)uaddr % sizeof(int) != 0) {
+		*err = EINVAL;
+		return -1;
+	}
+
+	switch (op) {
+	    case FUTEX_WAIT:
+		*err = futex_wait(proc, uaddr, val);
+		return *err ? -1 : 0;
+	    case FUTEX_WAKE:
+		if (val <= 0) {
+			*err = EINVAL;
+			return -1;
+		}
+		return futex_wake(proc, uaddr, val);
+	}
+
+	*err = EINVAL;
+	return -1;
+}
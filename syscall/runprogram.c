@@ -159,11 +159,13 @@ runprogram(int nargs, char **args, struct process **created_proc)
     ctxt->executable = v;
 
 	// Start a new thread to warp to user mode
+    process_thread_reserve(proc, 0);
     result = thread_fork("user process",
                          run_process,
                          ctxt, 0, NULL);
     if (result)
     {
+        process_thread_unreserve(proc, 0);
         kfree(ctxt);
         as_activate(NULL);
         process_destroy(pid);
@@ -190,9 +192,8 @@ run_process(void *ptr, unsigned long num)
     char **args = ctxt->args;
     kfree(ctxt);
     
-    // attach process to thread
-    curthread->t_proc = proc;
-    proc->ps_thread = curthread;
+    // attach process to thread (ID 0 was reserved for us)
+    process_thread_attach(proc, 0);
     
 	// Activate address space
 	as_activate(proc->ps_addrspace);
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * User threads: more kernel threads in the same process, sharing its
+ * address space and FD table (see struct process).
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <thread.h>
+#include <current.h>
+#include <process.h>
+#include <addrspace.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+// The new kernel thread, on its way to user mode
+static
+void
+thread_start_user(void *p, unsigned long tid)
+{
+    struct process *proc = p;
+    struct uthread *ut = &proc->ps_threads[tid];
+    vaddr_t entry = ut->ut_entry;
+    vaddr_t arg = ut->ut_arg;
+    vaddr_t stack = ut->ut_stack;
+    
+    process_thread_attach(proc, (int)tid);
+    as_activate(proc->ps_addrspace);
+    
+    enter_new_thread(arg, stack, entry);
+    
+    // enter_new_thread() does not return
+    panic("enter_new_thread returned\n");
+}
+
+int
+sys_thread_create(userptr_t entry, userptr_t arg, int *err)
+{
+    struct process *proc = curthread->t_proc;
+    int tid;
+    
+    *err = process_thread_alloc(proc, (vaddr_t)entry, (vaddr_t)arg, &tid);
+    if (*err)
+        return -1;
+    
+    *err = thread_fork("user thread",
+                       thread_start_user,
+                       proc, tid,
+                       NULL);
+    if (*err)
+    {
+        process_thread_unreserve(proc, tid);
+        return -1;
+    }
+    
+    return tid;
+}
+
+int
+sys_thread_join(int tid, userptr_t status)
+{
+    int exitval, err;
+    
+    err = process_thread_join(curthread->t_proc, tid, &exitval);
+    if (err)
+        return err;
+    
+    // a NULL status means the caller doesn't want it
+    if (status == NULL)
+        return 0;
+    return copyout(&exitval, status, sizeof(int));
+}
+
+int
+sys_thread_exit(int exitval)
+{
+    process_thread_exit(exitval);
+    
+    // should not return from process_thread_exit()
+    panic("process_thread_exit() returned\n");
+    return EINVAL;
+}
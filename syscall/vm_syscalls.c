@@ -42,9 +42,12 @@ sys_sbrk(intptr_t amount, int *err)
 {
     vaddr_t new_heaptop;
     
-    struct addrspace *as = curthread->t_proc->ps_addrspace;
+    struct process *proc = curthread->t_proc;
     
-    *err = as_sbrk(as, amount, &new_heaptop);
+    // the heap mustn't grow into a thread stack being set up
+    lock_acquire(proc->ps_lock);
+    *err = as_sbrk(proc->ps_addrspace, amount, &new_heaptop);
+    lock_release(proc->ps_lock);
     if (*err)
         return 0;
     
@@ -54,6 +57,27 @@ sys_sbrk(intptr_t amount, int *err)
 int
 sys_vmstat(userptr_t buf)
 {
-    return copyout(&vs_global, buf, sizeof(struct vmstat));
+    struct vmstat vs;
+    
+    // sum the per-CPU counters
+    vs_snapshot(&vs);
+    return copyout(&vs, buf, sizeof(struct vmstat));
+}
+
+int
+sys_memstat(userptr_t buf)
+{
+    struct memstat ms;
+    
+    as_memstat(curthread->t_proc->ps_addrspace, &ms);
+    return copyout(&ms, buf, sizeof(struct memstat));
+}
+
+int
+sys_rsslimit(size_t npages)
+{
+    // takes effect on the next eviction; 0 removes the limit
+    curthread->t_proc->ps_addrspace->as_rss_limit = npages;
+    return 0;
 }
 
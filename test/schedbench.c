@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Scheduler benchmarks.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <test.h>
+
+#define NCTXTHREADS	8
+#define NCTXYIELDS	2000
+
+static struct semaphore *ctxsem;
+static volatile unsigned ctxyields;
+
+/*
+ * Yield repeatedly at a fixed priority.  The priority is reset before
+ * every yield because the scheduler adjusts it as the thread runs.
+ */
+static
+void
+ctxthread(void *junk, unsigned long prio)
+{
+	(void)junk;
+
+	for (unsigned i = 0; i < ctxyields; i++) {
+		curthread->t_priority = prio;
+		thread_yield();
+	}
+	V(ctxsem);
+}
+
+/*
+ * Run NCTXTHREADS yielding threads spread over NPRIOR priority
+ * levels, starting from the worst, and report the time per switch.
+ */
+static
+void
+ctxrun(int nprior)
+{
+	time_t secs0, secs1, secs;
+	uint32_t nsecs0, nsecs1, nsecs;
+	int i, result;
+
+	gettime(&secs0, &nsecs0);
+
+	for (i=0; i<NCTXTHREADS; i++) {
+		result = thread_fork("ctxbench", ctxthread, NULL,
+				     PRIORITY_MAX - (i % nprior), NULL);
+		if (result) {
+			panic("ctxbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NCTXTHREADS; i++) {
+		P(ctxsem);
+	}
+
+	gettime(&secs1, &nsecs1);
+	getinterval(secs0, nsecs0, secs1, nsecs1, &secs, &nsecs);
+
+	/* microseconds fit in 32 bits for any sane run */
+	uint32_t usecs = secs * 1000000 + nsecs / 1000;
+	uint32_t nswitches = NCTXTHREADS * ctxyields;
+	uint32_t nsper = (usecs / nswitches) * 1000
+		+ ((usecs % nswitches) * 1000) / nswitches;
+
+	kprintf("%d priorit%s: %u switches in %lu.%09lu sec, %u ns/switch\n",
+		nprior, nprior == 1 ? "y " : "ies", nswitches,
+		(unsigned long)secs, (unsigned long)nsecs, nsper);
+}
+
+/*
+ * Context switch microbenchmark.  Switch cost should not depend on
+ * how many priority levels the run queue has threads on.  On a
+ * multiprocessor the figures are aggregate throughput.
+ *
+ * Usage: cs [yields-per-thread]
+ */
+int
+ctxbench(int nargs, char **args)
+{
+	ctxyields = NCTXYIELDS;
+	if (nargs > 1) {
+		ctxyields = atoi(args[1]);
+		if (ctxyields == 0) {
+			kprintf("Usage: cs [yields-per-thread]\n");
+			return EINVAL;
+		}
+	}
+
+	if (ctxsem == NULL) {
+		ctxsem = sem_create("ctxsem", 0);
+		if (ctxsem == NULL) {
+			panic("ctxbench: sem_create failed\n");
+		}
+	}
+
+	kprintf("Starting context switch benchmark...\n");
+	for (int nprior = 1; nprior <= PRIORITY_MAX + 1; nprior++) {
+		ctxrun(nprior);
+	}
+	kprintf("Context switch benchmark done.\n");
+
+	return 0;
+}
+
+#define NFAIRTHREADS	4
+#define FAIRSECS	5
+
+/* Weights in proportion 1:2:2:4, so ideal shares 11%:22%:22%:44%. */
+static const unsigned fairweights[NFAIRTHREADS] = {
+	FS_WEIGHT_DEFAULT / 2,
+	FS_WEIGHT_DEFAULT,
+	FS_WEIGHT_DEFAULT,
+	2 * FS_WEIGHT_DEFAULT,
+};
+
+static struct semaphore *fairsem;
+static volatile bool fairstop;
+static volatile uint32_t fairloops[NFAIRTHREADS];
+
+/*
+ * Spin on cpu 0 until told to stop, counting loops as a measure of
+ * the cpu time received.
+ */
+static
+void
+fairthread(void *junk, unsigned long n)
+{
+	int result;
+
+	(void)junk;
+
+	result = thread_setaffinity(1);
+	KASSERT(result == 0);
+	result = thread_setweight(fairweights[n]);
+	KASSERT(result == 0);
+
+	while (!fairstop) {
+		fairloops[n]++;
+	}
+	V(fairsem);
+}
+
+/*
+ * Fair-share benchmark. Runs NFAIRTHREADS cpu-bound threads with
+ * different weights on one cpu and reports each one's share of it
+ * next to the share its weight entitles it to. Only the fair-share
+ * scheduler (options fairshare) honors the weights.
+ *
+ * Usage: fair [seconds]
+ */
+int
+fairbench(int nargs, char **args)
+{
+	unsigned i, secs, totalweight;
+	uint64_t total;
+	int result;
+
+	secs = FAIRSECS;
+	if (nargs > 1) {
+		secs = atoi(args[1]);
+		if (secs == 0) {
+			kprintf("Usage: fair [seconds]\n");
+			return EINVAL;
+		}
+	}
+
+	if (fairsem == NULL) {
+		fairsem = sem_create("fairsem", 0);
+		if (fairsem == NULL) {
+			panic("fairbench: sem_create failed\n");
+		}
+	}
+
+	kprintf("Starting fair-share benchmark (%u sec)...\n", secs);
+	fairstop = false;
+	for (i=0; i<NFAIRTHREADS; i++) {
+		fairloops[i] = 0;
+		result = thread_fork("fairbench", fairthread, NULL, i, NULL);
+		if (result) {
+			panic("fairbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	clocksleep(secs);
+	fairstop = true;
+	for (i=0; i<NFAIRTHREADS; i++) {
+		P(fairsem);
+	}
+
+	total = 0;
+	totalweight = 0;
+	for (i=0; i<NFAIRTHREADS; i++) {
+		total += fairloops[i];
+		totalweight += fairweights[i];
+	}
+	if (total == 0) {
+		total = 1;
+	}
+
+	/* shares in tenths of a percent */
+	kprintf("thread  weight       loops   share  ideal\n");
+	for (i=0; i<NFAIRTHREADS; i++) {
+		unsigned share = fairloops[i] * (uint64_t)1000 / total;
+		unsigned ideal = fairweights[i] * 1000 / totalweight;
+		kprintf("%6u  %6u  %10u  %3u.%u%%  %3u.%u%%\n", i,
+			fairweights[i], fairloops[i],
+			share / 10, share % 10, ideal / 10, ideal % 10);
+	}
+	kprintf("Fair-share benchmark done.\n");
+
+	return 0;
+}
+
+#define NFORKS		2000
+#define NFORKBATCH	16
+
+static struct semaphore *forksem;
+
+static
+void
+forkthread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	V(forksem);
+}
+
+/*
+ * Fork NFORKS threads that exit at once, NFORKBATCH at a time so
+ * there are always some to reap, and report the rate.
+ */
+static
+void
+forkrun(const char *what, unsigned nforks)
+{
+	time_t secs0, secs1, secs;
+	uint32_t nsecs0, nsecs1, nsecs;
+	unsigned i, j;
+	int result;
+
+	gettime(&secs0, &nsecs0);
+
+	for (i=0; i<nforks; i+=NFORKBATCH) {
+		for (j=0; j<NFORKBATCH; j++) {
+			result = thread_fork("forkbench", forkthread,
+					     NULL, 0, NULL);
+			if (result) {
+				panic("forkbench: thread_fork failed: %s\n",
+				      strerror(result));
+			}
+		}
+		for (j=0; j<NFORKBATCH; j++) {
+			P(forksem);
+		}
+	}
+
+	gettime(&secs1, &nsecs1);
+	getinterval(secs0, nsecs0, secs1, nsecs1, &secs, &nsecs);
+
+	uint64_t usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+	unsigned rate = usecs ? (uint64_t)i * 1000000 / usecs : 0;
+
+	kprintf("%s: %u forks in %lu.%09lu sec, %u forks/sec\n",
+		what, i, (unsigned long)secs, (unsigned long)nsecs, rate);
+}
+
+/*
+ * Thread fork/exit benchmark. Runs the same fork/exit loop with the
+ * per-cpu thread cache disabled and then enabled, to show what
+ * recycling exited threads and their stacks saves.
+ *
+ * Usage: fb [forks]
+ */
+int
+forkbench(int nargs, char **args)
+{
+	unsigned nforks, limit;
+
+	nforks = NFORKS;
+	if (nargs > 1) {
+		nforks = atoi(args[1]);
+		if (nforks == 0) {
+			kprintf("Usage: fb [forks]\n");
+			return EINVAL;
+		}
+	}
+
+	if (forksem == NULL) {
+		forksem = sem_create("forksem", 0);
+		if (forksem == NULL) {
+			panic("forkbench: sem_create failed\n");
+		}
+	}
+
+	kprintf("Starting fork/exit benchmark...\n");
+	limit = thread_setcachelimit(0);
+	forkrun("uncached", nforks);
+	thread_setcachelimit(limit);
+	forkrun("cached  ", nforks);
+	kprintf("Fork/exit benchmark done.\n");
+
+	return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Spinlock benchmark.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
+#include <spinlock.h>
+#include <thread.h>
+#include <current.h>
+#include <synch.h>
+#include <test.h>
+
+#define SPINSECS	1
+
+static struct spinlock spinbench_lock;
+static struct semaphore *spinsem;
+static volatile bool spingo, spinstop;
+static volatile unsigned spincount;	/* protected by spinbench_lock */
+
+/* Per-thread results */
+static uint32_t spinacquires[MAXCPUS];
+static uint64_t spincycles[MAXCPUS];
+static unsigned spincpu[MAXCPUS];
+
+/*
+ * Take and drop the lock as fast as possible until told to stop,
+ * timing each acquire.
+ */
+static
+void
+spinthread(void *junk, unsigned long n)
+{
+	uint32_t before, acquires;
+	uint64_t cycles;
+
+	(void)junk;
+
+	while (!spingo) {
+		/* wait for everyone to be running */
+	}
+
+	acquires = 0;
+	cycles = 0;
+	while (!spinstop) {
+		before = cpu_cycles();
+		spinlock_acquire(&spinbench_lock);
+		cycles += cpu_cycles() - before;
+		spincount++;
+		spinlock_release(&spinbench_lock);
+		acquires++;
+	}
+
+	spinacquires[n] = acquires;
+	spincycles[n] = cycles;
+	spincpu[n] = curcpu->c_number;
+	V(spinsem);
+}
+
+/*
+ * Run NTHREADS threads hammering the lock for SPINSECS and report
+ * the mean cycles per acquire, and the fewest and most acquires any
+ * thread got as a percentage of the fair share (100% is perfectly
+ * fair). With no more threads than cpus, idle cpus steal the threads
+ * so each gets a cpu of its own; the cpus they ended up on are shown.
+ */
+static
+void
+spinrun(bool ticket, unsigned nthreads)
+{
+	uint32_t total, least, most, fair;
+	uint64_t cycles;
+	unsigned i;
+	int result;
+
+	if (ticket) {
+		spinlock_init_ticket(&spinbench_lock);
+	}
+	else {
+		spinlock_init(&spinbench_lock);
+		/* even under options ticketlocks */
+		spinbench_lock.lk_ticket = false;
+	}
+	spincount = 0;
+	spingo = false;
+	spinstop = false;
+
+	for (i=0; i<nthreads; i++) {
+		result = thread_fork("spinbench", spinthread, NULL, i, NULL);
+		if (result) {
+			panic("spinbench: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	spingo = true;
+	clocksleep(SPINSECS);
+	spinstop = true;
+	for (i=0; i<nthreads; i++) {
+		P(spinsem);
+	}
+
+	total = 0;
+	cycles = 0;
+	least = ~(uint32_t)0;
+	most = 0;
+	for (i=0; i<nthreads; i++) {
+		total += spinacquires[i];
+		cycles += spincycles[i];
+		if (spinacquires[i] < least) {
+			least = spinacquires[i];
+		}
+		if (spinacquires[i] > most) {
+			most = spinacquires[i];
+		}
+	}
+	KASSERT(total == spincount);
+	fair = total / nthreads;
+	if (fair == 0) {
+		fair = 1;
+	}
+
+	kprintf("%-6s %4u  %10u  %8u  %6u%%  %6u%%  cpus",
+		ticket ? "ticket" : "tas", nthreads, total,
+		(unsigned)(cycles / (total ? total : 1)),
+		(unsigned)(least * (uint64_t)100 / fair),
+		(unsigned)(most * (uint64_t)100 / fair));
+	for (i=0; i<nthreads; i++) {
+		kprintf(" %u", spincpu[i]);
+	}
+	kprintf("\n");
+
+	spinlock_cleanup(&spinbench_lock);
+}
+
+/*
+ * Spinlock microbenchmark. Compares test-and-set and ticket spinlocks
+ * under contention from one thread per cpu, for 1 up to all cpus.
+ * Per-acquire latency should grow more slowly, and the spread between
+ * the least and most served threads stay narrower, for ticket locks.
+ *
+ * Usage: sl
+ */
+int
+spinbench(int nargs, char **args)
+{
+	unsigned n, ncpus;
+
+	(void)nargs;
+	(void)args;
+
+	if (spinsem == NULL) {
+		spinsem = sem_create("spinsem", 0);
+		if (spinsem == NULL) {
+			panic("spinbench: sem_create failed\n");
+		}
+	}
+
+	ncpus = thread_numcpus();
+	kprintf("Starting spinlock benchmark...\n");
+	kprintf("%-6s %4s  %10s  %8s  %7s  %7s\n",
+		"lock", "thr", "acquires", "cyc/acq", "least", "most");
+	for (n = 1; n <= ncpus; n++) {
+		spinrun(false, n);
+		spinrun(true, n);
+	}
+	kprintf("Spinlock benchmark done.\n");
+
+	return 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Callout timer wheels. See callout.h.
+ */
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <current.h>
+#include <clock.h>
+#include <callout.h>
+#include <platform/maxcpus.h>
+
+/* Wheel size; must be a power of 2. */
+#define CALLOUT_WHEELSIZE	64
+#define CALLOUT_MASK		(CALLOUT_WHEELSIZE - 1)
+
+/* Wraparound-safe "tick A is at or before tick B". */
+#define CALLOUT_DUE(a, b)	((int)((a) - (b)) <= 0)
+
+struct callout_wheel {
+	struct spinlock cw_lock;	/* protects the rest */
+	unsigned cw_ticks;		/* hardclocks this wheel has seen */
+	struct callout *cw_buckets[CALLOUT_WHEELSIZE];
+};
+
+static struct callout_wheel callout_wheels[MAXCPUS];
+
+void
+callout_bootstrap(void)
+{
+	unsigned i, j;
+
+	for (i=0; i<MAXCPUS; i++) {
+		spinlock_init(&callout_wheels[i].cw_lock);
+		callout_wheels[i].cw_ticks = 0;
+		for (j=0; j<CALLOUT_WHEELSIZE; j++) {
+			callout_wheels[i].cw_buckets[j] = NULL;
+		}
+	}
+}
+
+void
+callout_init(struct callout *co, void (*func)(void *), void *arg)
+{
+	co->co_next = NULL;
+	co->co_prevp = NULL;
+	co->co_wheel = -1;
+	co->co_expire = 0;
+	co->co_func = func;
+	co->co_arg = arg;
+}
+
+/*
+ * Take CO off its bucket. The wheel must be locked.
+ */
+static
+void
+callout_unlink(struct callout *co)
+{
+	*co->co_prevp = co->co_next;
+	if (co->co_next != NULL) {
+		co->co_next->co_prevp = co->co_prevp;
+	}
+	co->co_next = NULL;
+	co->co_prevp = NULL;
+	co->co_wheel = -1;
+}
+
+bool
+callout_stop(struct callout *co)
+{
+	struct callout_wheel *cw;
+	int wheel;
+
+	/*
+	 * co_wheel is read unlocked, so the callout might move or fire
+	 * before we get the wheel locked; check again once we have.
+	 */
+	while ((wheel = co->co_wheel) >= 0) {
+		cw = &callout_wheels[wheel];
+		spinlock_acquire(&cw->cw_lock);
+		if (co->co_wheel == wheel) {
+			callout_unlink(co);
+			spinlock_release(&cw->cw_lock);
+			return true;
+		}
+		spinlock_release(&cw->cw_lock);
+	}
+	return false;
+}
+
+void
+callout_schedule(struct callout *co, unsigned ticks)
+{
+	struct callout_wheel *cw;
+	struct callout **bucket;
+	int spl;
+
+	KASSERT(co->co_func != NULL);
+
+	callout_stop(co);
+	if (ticks == 0) {
+		ticks = 1;
+	}
+
+	/* stay on this cpu until we have its wheel locked */
+	spl = splhigh();
+	cw = &callout_wheels[curcpu->c_number];
+	spinlock_acquire(&cw->cw_lock);
+
+	co->co_wheel = curcpu->c_number;
+	co->co_expire = cw->cw_ticks + ticks;
+	bucket = &cw->cw_buckets[co->co_expire & CALLOUT_MASK];
+	co->co_next = *bucket;
+	if (co->co_next != NULL) {
+		co->co_next->co_prevp = &co->co_next;
+	}
+	co->co_prevp = bucket;
+	*bucket = co;
+
+	spinlock_release(&cw->cw_lock);
+	splx(spl);
+}
+
+bool
+callout_pending(struct callout *co)
+{
+	return co->co_wheel >= 0;
+}
+
+unsigned
+callout_ticks(time_t secs, uint32_t nsecs)
+{
+	uint64_t ticks;
+
+	ticks = (uint64_t)secs * HZ;
+	ticks += ((uint64_t)nsecs * HZ + 999999999) / 1000000000;
+	return ticks > 0xffffffff ? 0xffffffff : (unsigned)ticks;
+}
+
+unsigned
+callout_nextevent(unsigned max)
+{
+	struct callout_wheel *cw;
+	struct callout *co;
+	unsigned i, next;
+	int delta;
+
+	cw = &callout_wheels[curcpu->c_number];
+	next = max;
+
+	spinlock_acquire(&cw->cw_lock);
+	for (i=0; i<CALLOUT_WHEELSIZE; i++) {
+		for (co = cw->cw_buckets[i]; co != NULL; co = co->co_next) {
+			delta = (int)(co->co_expire - cw->cw_ticks);
+			if (delta < 1) {
+				/* overdue; fires when its bucket comes up */
+				delta = 1;
+			}
+			if ((unsigned)delta < next) {
+				next = delta;
+			}
+		}
+	}
+	spinlock_release(&cw->cw_lock);
+	return next;
+}
+
+/*
+ * Advance this cpu's wheel by one tick and run whatever is due. Each
+ * due callout is unlinked and its function called with the wheel
+ * unlocked, so the function may reschedule it (or anything else).
+ * Once unlinked a callout is fair game for callout_schedule on any
+ * cpu, so rather than collecting the due ones on a private list, go
+ * back to the bucket for each. Buckets are short.
+ */
+void
+callout_hardclock(void)
+{
+	struct callout_wheel *cw;
+	struct callout *co;
+	void (*func)(void *);
+	void *arg;
+	unsigned now;
+
+	cw = &callout_wheels[curcpu->c_number];
+
+	spinlock_acquire(&cw->cw_lock);
+	now = ++cw->cw_ticks;
+	while (1) {
+		for (co = cw->cw_buckets[now & CALLOUT_MASK]; co != NULL;
+		     co = co->co_next) {
+			if (CALLOUT_DUE(co->co_expire, now)) {
+				break;
+			}
+		}
+		if (co == NULL) {
+			break;
+		}
+		callout_unlink(co);
+		func = co->co_func;
+		arg = co->co_arg;
+		spinlock_release(&cw->cw_lock);
+
+		func(arg);
+
+		spinlock_acquire(&cw->cw_lock);
+	}
+	spinlock_release(&cw->cw_lock);
+}
@@ -30,19 +30,23 @@
 #include <types.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spl.h>
 #include <wchan.h>
+#include <mainbus.h>
 #include <clock.h>
+#include <callout.h>
 #include <thread.h>
 #include <current.h>
 
 #include "opt-roundrobin.h"
+#include "opt-fairshare.h"
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution that one second.
+ * This is pretty primitive, though callouts (see callout.h) now allow
+ * scheduling callbacks at specific points in the future, to the
+ * resolution of one hardclock.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -53,23 +57,56 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	16	/* Reschedule every 16 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define MIGRATE_HARDCLOCKS	64	/* Migrate every 64 hardclocks. */
+					/* (idle CPUs steal work anyway) */
+#define IDLE_HARDCLOCKS		HZ	/* Max hardclocks to skip idling. */
+
+/*
+ * Set once there is a time-of-day clock to catch up from; until then
+ * idle cpus keep ticking.
+ */
+static bool hardclock_tickless;
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
  */
 static struct wchan *lbolt;
 
+/*
+ * Threads in clocknanosleep wait on one of these, chosen by hashing
+ * the thread, so a wakeup disturbs few others.
+ */
+#define SLEEPQ_SIZE	16
+static struct wchan *sleepq[SLEEPQ_SIZE];
+
 /*
  * Setup.
  */
 void
 hardclock_bootstrap(void)
 {
+	unsigned i;
+
 	lbolt = wchan_create("lbolt");
 	if (lbolt == NULL) {
 		panic("Couldn't create lbolt\n");
 	}
+	for (i=0; i<SLEEPQ_SIZE; i++) {
+		sleepq[i] = wchan_create("nanosleep");
+		if (sleepq[i] == NULL) {
+			panic("Couldn't create sleep queue\n");
+		}
+	}
+	callout_bootstrap();
+}
+
+/*
+ * Allow tickless idle. Call once the time-of-day clock is attached.
+ */
+void
+hardclock_tickless_bootstrap(void)
+{
+	hardclock_tickless = true;
 }
 
 /*
@@ -95,6 +132,7 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+	callout_hardclock();
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
@@ -103,6 +141,8 @@ hardclock(void)
 	}
 #if OPT_ROUNDROBIN
     thread_yield();
+#elif OPT_FAIRSHARE
+    thread_fairshare_tick();
 #else
     // Decrement the number of timeslices remaining
     // If it's 0 make curthread yield
@@ -121,6 +161,76 @@ hardclock(void)
 #endif
 }
 
+/*
+ * Called by an idle cpu, with interrupts off, just before it waits for
+ * an interrupt. Nothing hardclock does is useful while there's nothing
+ * to run, so unless a callout is due at the next tick, stop the timer
+ * until one is (or for at most IDLE_HARDCLOCKS) and note the time, so
+ * hardclock_resume can account for the ticks that are skipped.
+ */
+void
+hardclock_idle(void)
+{
+	unsigned ticks;
+
+	KASSERT(curthread->t_curspl > 0);
+	KASSERT(curcpu->c_tickless == 0);
+
+	if (!hardclock_tickless) {
+		return;
+	}
+	ticks = callout_nextevent(IDLE_HARDCLOCKS);
+	if (ticks <= 1) {
+		return;
+	}
+
+	gettime(&curcpu->c_ticklesssecs, &curcpu->c_ticklessnsecs);
+	curcpu->c_tickless = ticks;
+	mainbus_settimer(ticks);
+}
+
+/*
+ * Restart the timer on a cpu that stopped it in hardclock_idle. This
+ * is called on the way into every interrupt, so the clock and callouts
+ * are current before any handler runs, and again when the cpu stops
+ * idling; it does nothing if the timer is running.
+ *
+ * The hardclocks that would have happened while the timer was off
+ * are counted and their callouts run now, short of the last one: if
+ * it's the timer that woke us, the hardclock() that follows is that.
+ */
+void
+hardclock_resume(void)
+{
+	time_t secs;
+	uint32_t nsecs;
+	unsigned elapsed;
+	int spl;
+
+	spl = splhigh();
+	if (curcpu->c_tickless == 0) {
+		splx(spl);
+		return;
+	}
+
+	gettime(&secs, &nsecs);
+	getinterval(curcpu->c_ticklesssecs, curcpu->c_ticklessnsecs,
+		    secs, nsecs, &secs, &nsecs);
+	elapsed = callout_ticks(secs, 0) + nsecs / (1000000000 / HZ);
+	if (elapsed > curcpu->c_tickless - 1) {
+		elapsed = curcpu->c_tickless - 1;
+	}
+	curcpu->c_tickless = 0;
+	mainbus_settimer(1);
+
+	curcpu->c_hardclocks += elapsed;
+	curcpu->c_idleclocks += elapsed;
+	while (elapsed-- > 0) {
+		callout_hardclock();
+	}
+	splx(spl);
+}
+
 /*
  * Suspend execution for n seconds.
  */
@@ -133,3 +243,53 @@ clocksleep(int num_secs)
 		num_secs--;
 	}
 }
+
+/*
+ * State shared by a thread in clocknanosleep and its wakeup callout.
+ */
+struct clocksleeper {
+	volatile bool cs_done;
+	struct wchan *cs_wchan;
+};
+
+static
+void
+clocknanosleep_wakeup(void *arg)
+{
+	struct clocksleeper *cs = arg;
+	struct wchan *wc;
+
+	/* once cs_done is set the sleeper may return and CS be gone */
+	wc = cs->cs_wchan;
+	cs->cs_done = true;
+	wchan_wakeall(wc);
+}
+
+/*
+ * Suspend execution for at least SECS seconds plus NSECS nanoseconds,
+ * rounded up to whole hardclocks.
+ */
+void
+clocknanosleep(time_t secs, uint32_t nsecs)
+{
+	struct clocksleeper cs;
+	struct callout co;
+	unsigned ticks;
+
+	ticks = callout_ticks(secs, nsecs);
+	if (ticks == 0) {
+		return;
+	}
+
+	cs.cs_done = false;
+	cs.cs_wchan = sleepq[((uintptr_t)curthread >> 4) % SLEEPQ_SIZE];
+	callout_init(&co, clocknanosleep_wakeup, &cs);
+	callout_schedule(&co, ticks);
+
+	wchan_lock(cs.cs_wchan);
+	while (!cs.cs_done) {
+		wchan_sleep(cs.cs_wchan);
+		wchan_lock(cs.cs_wchan);
+	}
+	wchan_unlock(cs.cs_wchan);
+}
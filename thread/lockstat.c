@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lock contention profiling. See lockstat.h.
+ */
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <current.h>
+#include <platform/maxcpus.h>
+#include <lockstat.h>
+
+/* Class names are copied, and cut to fit. */
+#define LOCKSTAT_NAMELEN	24
+
+struct lockstat_counts {
+	uint32_t lc_acquires;		/* times acquired */
+	uint32_t lc_contended;		/* ... when someone else had it */
+	uint32_t lc_waitmax;		/* longest wait */
+	uint64_t lc_wait;		/* total wait */
+	uint64_t lc_hold;		/* total hold */
+};
+
+/* Class table. Class 0 catches whatever doesn't fit. */
+static struct spinlock ls_lock = SPINLOCK_INITIALIZER;	/* not profiled */
+static char ls_names[LOCKSTAT_NCLASSES][LOCKSTAT_NAMELEN] = { "(other)" };
+static int ls_nclasses = 1;
+
+/* Counts, per cpu. */
+static struct lockstat_counts ls_counts[MAXCPUS][LOCKSTAT_NCLASSES];
+
+/*
+ * Compare NAME with a (possibly cut short) class name.
+ */
+static
+bool
+lockstat_nameeq(const char *clsname, const char *name)
+{
+	int i;
+
+	for (i=0; i<LOCKSTAT_NAMELEN-1; i++) {
+		if (clsname[i] != name[i]) {
+			return false;
+		}
+		if (name[i] == '\0') {
+			return true;
+		}
+	}
+	return true;
+}
+
+/*
+ * Find or make the class for NAME. No memory is allocated, so this is
+ * safe to call before kmalloc works.
+ */
+int
+lockstat_class(const char *name)
+{
+	int cls, i;
+
+	spinlock_acquire(&ls_lock);
+	for (cls=0; cls<ls_nclasses; cls++) {
+		if (lockstat_nameeq(ls_names[cls], name)) {
+			break;
+		}
+	}
+	if (cls == ls_nclasses) {
+		if (ls_nclasses == LOCKSTAT_NCLASSES) {
+			cls = 0;
+		}
+		else {
+			for (i=0; i<LOCKSTAT_NAMELEN-1 && name[i]; i++) {
+				ls_names[cls][i] = name[i];
+			}
+			ls_names[cls][i] = '\0';
+			ls_nclasses++;
+		}
+	}
+	spinlock_release(&ls_lock);
+
+	return cls;
+}
+
+void
+lockstat_acquired(int cls, bool contended, uint32_t waitcycles)
+{
+	struct lockstat_counts *lc;
+	int spl;
+
+	KASSERT(cls >= 0 && cls < LOCKSTAT_NCLASSES);
+
+	/* the early boot cpu has no number yet */
+	if (!CURCPU_EXISTS()) {
+		return;
+	}
+
+	spl = splhigh();
+	lc = &ls_counts[curcpu->c_number][cls];
+	lc->lc_acquires++;
+	if (contended) {
+		lc->lc_contended++;
+		lc->lc_wait += waitcycles;
+		if (waitcycles > lc->lc_waitmax) {
+			lc->lc_waitmax = waitcycles;
+		}
+	}
+	splx(spl);
+}
+
+void
+lockstat_released(int cls, uint32_t holdcycles)
+{
+	int spl;
+
+	KASSERT(cls >= 0 && cls < LOCKSTAT_NCLASSES);
+
+	if (!CURCPU_EXISTS()) {
+		return;
+	}
+
+	spl = splhigh();
+	ls_counts[curcpu->c_number][cls].lc_hold += holdcycles;
+	splx(spl);
+}
+
+/*
+ * Print per-class totals, sorted by total wait. The per-cpu counts are
+ * read without locking, so a busy system may show slightly stale
+ * numbers.
+ */
+void
+lockstat_print(void)
+{
+	struct lockstat_counts *tot, *lc;
+	int order[LOCKSTAT_NCLASSES];
+	int ncls, cls, i, j;
+	unsigned cpu;
+
+	tot = kmalloc(LOCKSTAT_NCLASSES * sizeof(*tot));
+	if (tot == NULL) {
+		kprintf("lockstat: Out of memory\n");
+		return;
+	}
+
+	ncls = ls_nclasses;
+	for (cls=0; cls<ncls; cls++) {
+		bzero(&tot[cls], sizeof(tot[cls]));
+		for (cpu=0; cpu<MAXCPUS; cpu++) {
+			lc = &ls_counts[cpu][cls];
+			tot[cls].lc_acquires += lc->lc_acquires;
+			tot[cls].lc_contended += lc->lc_contended;
+			tot[cls].lc_wait += lc->lc_wait;
+			tot[cls].lc_hold += lc->lc_hold;
+			if (lc->lc_waitmax > tot[cls].lc_waitmax) {
+				tot[cls].lc_waitmax = lc->lc_waitmax;
+			}
+		}
+
+		/* insertion sort, most total wait first */
+		for (i=cls; i>0 && tot[order[i-1]].lc_wait < tot[cls].lc_wait;
+		     i--) {
+			order[i] = order[i-1];
+		}
+		order[i] = cls;
+	}
+
+	kprintf("%-23s %9s %9s %12s %10s %12s\n", "lock", "acquires",
+		"contended", "wait(cyc)", "maxwait", "hold(cyc)");
+	for (j=0; j<ncls; j++) {
+		cls = order[j];
+		if (tot[cls].lc_acquires == 0) {
+			continue;
+		}
+		kprintf("%-23s %9u %9u %12llu %10u %12llu\n", ls_names[cls],
+			tot[cls].lc_acquires, tot[cls].lc_contended,
+			(unsigned long long)tot[cls].lc_wait,
+			tot[cls].lc_waitmax,
+			(unsigned long long)tot[cls].lc_hold);
+	}
+
+	kfree(tot);
+}
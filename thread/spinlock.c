@@ -49,7 +49,61 @@ void
 spinlock_init(struct spinlock *lk)
 {
 	spinlock_data_set(&lk->lk_lock, 0);
+	spinlock_data_set(&lk->lk_serving, 0);
+	lk->lk_ticket = OPT_TICKETLOCKS;
 	lk->lk_holder = NULL;
+#if OPT_LOCKSTAT
+	lk->lk_stat = LOCKSTAT_NONE;
+	lk->lk_acqtime = 0;
+#endif
+}
+
+/*
+ * Initialize a spinlock that queues its waiters regardless of the
+ * kernel config. For locks that are hot enough for fairness to matter.
+ */
+void
+spinlock_init_ticket(struct spinlock *lk)
+{
+	spinlock_init(lk);
+	lk->lk_ticket = true;
+}
+
+/*
+ * Name a spinlock for lock profiling. Spinlocks are cheap and many, so
+ * only the ones named here are profiled.
+ */
+void
+spinlock_setname(struct spinlock *lk, const char *name)
+{
+#if OPT_LOCKSTAT
+	lk->lk_stat = lockstat_class(name);
+#else
+	(void)lk;
+	(void)name;
+#endif
+}
+
+/*
+ * Note that we got the lock, having started trying at cycle START.
+ */
+static
+inline
+void
+spinlock_gotit(struct spinlock *lk, struct cpu *mycpu,
+	       uint32_t start, bool contended)
+{
+	lk->lk_holder = mycpu;
+#if OPT_LOCKSTAT
+	if (lk->lk_stat != LOCKSTAT_NONE) {
+		lk->lk_acqtime = cpu_cycles();
+		lockstat_acquired(lk->lk_stat, contended,
+				  lk->lk_acqtime - start);
+	}
+#else
+	(void)start;
+	(void)contended;
+#endif
 }
 
 /*
@@ -59,7 +113,13 @@ void
 spinlock_cleanup(struct spinlock *lk)
 {
 	KASSERT(lk->lk_holder == NULL);
-	KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	if (lk->lk_ticket) {
+		KASSERT(spinlock_data_get(&lk->lk_lock) ==
+			spinlock_data_get(&lk->lk_serving));
+	}
+	else {
+		KASSERT(spinlock_data_get(&lk->lk_lock) == 0);
+	}
 }
 
 /*
@@ -68,14 +128,27 @@ spinlock_cleanup(struct spinlock *lk)
  * First disable interrupts (otherwise, if we get a timer interrupt we
  * might come back to this lock and deadlock), then use a machine-level
  * atomic operation to wait for the lock to be free.
+ *
+ * For a ticket lock the atomic operation takes a ticket, and we wait
+ * for the holder to hand the lock on to it. That only reads the lock,
+ * so waiters don't fight over the bus, and it serves them in order.
  */
 void
 spinlock_acquire(struct spinlock *lk)
 {
 	struct cpu *mycpu;
+	spinlock_data_t ticket;
+	uint32_t start = 0;
+	bool contended = false;
 
 	splraise(IPL_NONE, IPL_HIGH);
 
+#if OPT_LOCKSTAT
+	if (lk->lk_stat != LOCKSTAT_NONE) {
+		start = cpu_cycles();
+	}
+#endif
+
 	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
 		mycpu = curcpu->c_self;
@@ -87,6 +160,15 @@ spinlock_acquire(struct spinlock *lk)
 		mycpu = NULL;
 	}
 
+	if (lk->lk_ticket) {
+		ticket = spinlock_data_fetchadd(&lk->lk_lock, 1);
+		while (spinlock_data_get(&lk->lk_serving) != ticket) {
+			contended = true;
+		}
+		spinlock_gotit(lk, mycpu, start, contended);
+		return;
+	}
+
 	while (1) {
 		/*
 		 * Do test-test-and-set, that is, read first before
@@ -99,15 +181,17 @@ spinlock_acquire(struct spinlock *lk)
 		 * we don't.
 		 */
 		if (spinlock_data_get(&lk->lk_lock) != 0) {
+			contended = true;
 			continue;
 		}
 		if (spinlock_data_testandset(&lk->lk_lock) != 0) {
+			contended = true;
 			continue;
 		}
 		break;
 	}
 
-	lk->lk_holder = mycpu;
+	spinlock_gotit(lk, mycpu, start, contended);
 }
 
 /*
@@ -121,8 +205,19 @@ spinlock_release(struct spinlock *lk)
 		KASSERT(lk->lk_holder == curcpu->c_self);
 	}
 
+#if OPT_LOCKSTAT
+	if (lk->lk_stat != LOCKSTAT_NONE) {
+		lockstat_released(lk->lk_stat, cpu_cycles() - lk->lk_acqtime);
+	}
+#endif
 	lk->lk_holder = NULL;
-	spinlock_data_set(&lk->lk_lock, 0);
+	if (lk->lk_ticket) {
+		/* only the holder writes lk_serving */
+		spinlock_data_set(&lk->lk_serving, lk->lk_serving + 1);
+	}
+	else {
+		spinlock_data_set(&lk->lk_lock, 0);
+	}
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
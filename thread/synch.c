@@ -39,6 +39,8 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <cpu.h>
+#include <lockstat.h>
 
 ////////////////////////////////////////////////////////////
 //
@@ -147,6 +149,132 @@ V(struct semaphore *sem)
 //
 // Lock.
 
+/*
+ * How many times lock_acquire polls a lock whose holder is running
+ * before it gives up and sleeps. Roughly the length of a short
+ * critical section; much longer and spinning costs more than the
+ * two context switches it is meant to save.
+ */
+#define LOCK_SPIN_MAX 1000
+
+/*
+ * Priority inheritance. pi_lock protects every thread's t_donated and
+ * t_waitlock and every lock's lk_donation and lk_nwaiters. It is held
+ * while following a chain from a lock to its holder to the lock the
+ * holder is waiting for and so on, and since a lock with waiters is
+ * only let go of under pi_lock, none of the holders on the chain can
+ * release its lock and exit underneath us. Lock order is lk_metalock,
+ * then pi_lock, then the run queue locks.
+ */
+static struct spinlock pi_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * How far down a chain of holders a donation is passed. Deadlocked
+ * threads make the chain a cycle, so it needs some limit.
+ */
+#define PI_MAXDEPTH 8
+
+/*
+ * The current thread is about to sleep waiting for LOCK: count it as
+ * a waiter and lend its priority to the holder, and to whoever holds
+ * the lock the holder is waiting for, and so on. The caller holds
+ * LOCK's lk_metalock.
+ */
+static
+void
+lock_pi_wait(struct lock *lock)
+{
+	struct thread *holder;
+	unsigned prio;
+	int depth;
+
+	KASSERT(spinlock_do_i_hold(&lock->lk_metalock));
+
+	spinlock_acquire(&pi_lock);
+	curthread->t_waitlock = lock;
+	lock->lk_nwaiters++;
+
+	prio = THREAD_PRIORITY(curthread);
+	for (depth = 0; depth < PI_MAXDEPTH; depth++) {
+		if (prio < lock->lk_donation) {
+			lock->lk_donation = prio;
+		}
+		holder = lock->lk_holder;
+		if (holder == NULL || THREAD_PRIORITY(holder) <= prio) {
+			/* anything further on already has it too */
+			break;
+		}
+		thread_setdonated(holder, prio);
+		lock = holder->t_waitlock;
+		if (lock == NULL) {
+			break;
+		}
+	}
+	spinlock_release(&pi_lock);
+}
+
+/*
+ * The current thread has woken up from waiting for LOCK. Once the
+ * last waiter is gone, nothing is being lent through the lock any
+ * more. The caller holds LOCK's lk_metalock.
+ */
+static
+void
+lock_pi_unwait(struct lock *lock)
+{
+	KASSERT(spinlock_do_i_hold(&lock->lk_metalock));
+
+	spinlock_acquire(&pi_lock);
+	KASSERT(curthread->t_waitlock == lock);
+	curthread->t_waitlock = NULL;
+	KASSERT(lock->lk_nwaiters > 0);
+	if (--lock->lk_nwaiters == 0) {
+		lock->lk_donation = PRIORITY_NONE;
+	}
+	spinlock_release(&pi_lock);
+}
+
+/*
+ * Take LOCK off the current thread's list of held locks. Usually
+ * locks are released in the reverse order they were taken, so it's at
+ * the front.
+ */
+static
+void
+lock_unhold(struct lock *lock)
+{
+	struct lock **lp;
+
+	for (lp = &curthread->t_heldlocks; *lp != lock;
+	     lp = &(*lp)->lk_nextheld) {
+		KASSERT(*lp != NULL);
+	}
+	*lp = lock->lk_nextheld;
+	lock->lk_nextheld = NULL;
+}
+
+/*
+ * Work out what the current thread is owed from the locks it still
+ * holds. Call with pi_lock held.
+ */
+static
+unsigned
+lock_pi_owed(void)
+{
+	struct lock *lock;
+	unsigned prio = PRIORITY_NONE;
+
+	KASSERT(spinlock_do_i_hold(&pi_lock));
+
+	for (lock = curthread->t_heldlocks; lock != NULL;
+	     lock = lock->lk_nextheld) {
+		if (lock->lk_donation < prio) {
+			prio = lock->lk_donation;
+		}
+	}
+	return prio;
+}
+
 struct lock *
 lock_create(const char *name)
 {
@@ -171,6 +299,15 @@ lock_create(const char *name)
 	}
 	
 	lock->lk_holder = NULL;
+	lock->lk_ncontended = 0;
+	lock->lk_nspinwins = 0;
+	lock->lk_nwaiters = 0;
+	lock->lk_donation = PRIORITY_NONE;
+	lock->lk_nextheld = NULL;
+#if OPT_LOCKSTAT
+	lock->lk_stat = lockstat_class(name);
+	lock->lk_acqtime = 0;
+#endif
 	
 	spinlock_init(&lock->lk_metalock);
 
@@ -184,6 +321,7 @@ lock_destroy(struct lock *lock)
 	
 	// Cannot destroy a locked lock
 	KASSERT(lock->lk_holder == NULL);
+	KASSERT(lock->lk_nwaiters == 0);
 	
 	/* will assert if anyone's waiting on it */
 	spinlock_cleanup(&lock->lk_metalock);
@@ -201,16 +339,70 @@ lock_acquire(struct lock *lock)
 	// DO NOT BLOCK IN AN INTERRUPT!
 	KASSERT(!curthread->t_in_interrupt);
 	
+	struct thread *holder;
+	unsigned spins = 0;
+	bool contended, slept = false;
+#if OPT_LOCKSTAT
+	uint32_t start = cpu_cycles();
+#endif
+	
 	spinlock_acquire(&lock->lk_metalock);
-	while (lock->lk_holder != NULL)
+	contended = (lock->lk_holder != NULL);
+	while ((holder = lock->lk_holder) != NULL)
 	{
+		/*
+		 * If the holder is running (which means on another cpu),
+		 * it will probably let go soon; wait for that without
+		 * the cost of sleeping. Its state may only be looked at
+		 * under lk_metalock, as that keeps it from releasing the
+		 * lock and exiting, so while spinning watch only
+		 * lk_holder and come back here to check again.
+		 */
+		if (spins < LOCK_SPIN_MAX && holder->t_state == S_RUN) {
+			spinlock_release(&lock->lk_metalock);
+			while (lock->lk_holder == holder &&
+			       ++spins < LOCK_SPIN_MAX) {
+				/* spin */
+			}
+			spinlock_acquire(&lock->lk_metalock);
+			continue;
+		}
+		
+		lock_pi_wait(lock);
 		wchan_lock(lock->lk_wchan);
 		spinlock_release(&lock->lk_metalock);
 		wchan_sleep(lock->lk_wchan);
 		spinlock_acquire(&lock->lk_metalock);
+		lock_pi_unwait(lock);
+		slept = true;
+		spins = 0;
 	}
 	// Our turn! Actually acquire the lock.
 	lock->lk_holder = curthread;
+	lock->lk_nextheld = curthread->t_heldlocks;
+	curthread->t_heldlocks = lock;
+	if (lock->lk_nwaiters > 0) {
+		// Whatever is lent through the lock now comes to us.
+		spinlock_acquire(&pi_lock);
+		if (lock->lk_donation < curthread->t_donated) {
+			thread_setdonated(curthread, lock->lk_donation);
+		}
+		spinlock_release(&pi_lock);
+	}
+	if (contended) {
+		lock->lk_ncontended++;
+		if (!slept) {
+			lock->lk_nspinwins++;
+		}
+	}
+#if OPT_LOCKSTAT
+	/*
+	 * We may have moved cpus while asleep; this assumes the cpus'
+	 * cycle counters run in step, as they do on System/161.
+	 */
+	lock->lk_acqtime = cpu_cycles();
+	lockstat_acquired(lock->lk_stat, contended, lock->lk_acqtime - start);
+#endif
 	spinlock_release(&lock->lk_metalock);
 }
 
@@ -223,7 +415,21 @@ lock_release(struct lock *lock)
 	KASSERT(lock_do_i_hold(lock));
 	
 	spinlock_acquire(&lock->lk_metalock);
-	lock->lk_holder = NULL;
+#if OPT_LOCKSTAT
+	lockstat_released(lock->lk_stat, cpu_cycles() - lock->lk_acqtime);
+#endif
+	lock_unhold(lock);
+	if (lock->lk_nwaiters > 0 || curthread->t_donated != PRIORITY_NONE) {
+		// Give back what was lent through this lock; see pi_lock
+		// for why lk_holder is cleared under it.
+		spinlock_acquire(&pi_lock);
+		lock->lk_holder = NULL;
+		thread_setdonated(curthread, lock_pi_owed());
+		spinlock_release(&pi_lock);
+	}
+	else {
+		lock->lk_holder = NULL;
+	}
 	wchan_wakeone(lock->lk_wchan);
 	spinlock_release(&lock->lk_metalock);
 }
@@ -311,7 +517,10 @@ cv_signal(struct cv *cv, struct lock *lock)
 	// We must hold the lock
 	KASSERT(lock_do_i_hold(lock));
 	
-	wchan_wakeone(cv->cv_wchan);
+	// The waiter can't run until we release the lock anyway, so
+	// rather than waking it to find the lock held and sleep again,
+	// move it straight to the lock's queue (wait morphing).
+	wchan_moveone(cv->cv_wchan, lock->lk_wchan);
 }
 
 void
@@ -323,13 +532,20 @@ cv_broadcast(struct cv *cv, struct lock *lock)
 	// We must hold the lock
 	KASSERT(lock_do_i_hold(lock));
 	
-	wchan_wakeall(cv->cv_wchan);
+	// As in cv_signal; lock_release then wakes the waiters one at
+	// a time as each gets the lock and lets it go, instead of all
+	// of them at once to fight over it.
+	wchan_moveall(cv->cv_wchan, lock->lk_wchan);
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Reader-Writer Mutex
 
+/* rw_state: the writer bit, and the mask for the reader count */
+#define RW_WRITER   0x80000000
+#define RW_READERS  0x7fffffff
+
 struct rw_mutex *
 rw_create(const char *name)
 {
@@ -346,35 +562,34 @@ rw_create(const char *name)
 		return NULL;
 	}
 	
-    // initialize lock
-	rw->rw_lock = lock_create(rw->rw_name);
-	if (rw->rw_lock == NULL) {
+    // initialize writer lock
+	rw->rw_wlock = lock_create(rw->rw_name);
+	if (rw->rw_wlock == NULL) {
 		kfree(rw->rw_name);
 		kfree(rw);
 		return NULL;
 	}
     
-    // initialize CVs
-    rw->rw_reader_cv = cv_create(rw->rw_name);
-	if (rw->rw_reader_cv == NULL) {
-        lock_destroy(rw->rw_lock);
+    // initialize wait channels
+    rw->rw_readers_wchan = wchan_create(rw->rw_name);
+	if (rw->rw_readers_wchan == NULL) {
+        lock_destroy(rw->rw_wlock);
 		kfree(rw->rw_name);
 		kfree(rw);
 		return NULL;
 	}
     
-    rw->rw_writer_cv = cv_create(rw->rw_name);
-	if (rw->rw_writer_cv == NULL) {
-        cv_destroy(rw->rw_reader_cv);
-        lock_destroy(rw->rw_lock);
+    rw->rw_drain_wchan = wchan_create(rw->rw_name);
+	if (rw->rw_drain_wchan == NULL) {
+        wchan_destroy(rw->rw_readers_wchan);
+        lock_destroy(rw->rw_wlock);
 		kfree(rw->rw_name);
 		kfree(rw);
 		return NULL;
 	}
     
-    // initialize counters
-    rw->rw_nreaders = 0;
-    rw->rw_nwriters = 0;
+    // no readers, no writer
+    spinlock_data_set(&rw->rw_state, 0);
     
 	return rw;
 }
@@ -384,11 +599,11 @@ rw_destroy(struct rw_mutex *rw)
 {
     KASSERT(rw != NULL);
     
-    KASSERT(rw->rw_nreaders ==0 && rw->rw_nwriters == 0);
+    KASSERT(spinlock_data_get(&rw->rw_state) == 0);
     
-    cv_destroy(rw->rw_writer_cv);
-    cv_destroy(rw->rw_reader_cv);
-    lock_destroy(rw->rw_lock);
+    wchan_destroy(rw->rw_drain_wchan);
+    wchan_destroy(rw->rw_readers_wchan);
+    lock_destroy(rw->rw_wlock);
     kfree(rw->rw_name);
     kfree(rw);
 }
@@ -396,49 +611,78 @@ rw_destroy(struct rw_mutex *rw)
 void
 rw_rlock(struct rw_mutex *rw)
 {
+    spinlock_data_t state;
+    
     KASSERT(rw != NULL);
+    KASSERT(!curthread->t_in_interrupt);
     
-    lock_acquire(rw->rw_lock);
-    while (rw->rw_nwriters > 0)
-        cv_wait(rw->rw_reader_cv, rw->rw_lock);
-    rw->rw_nreaders++;
-    lock_release(rw->rw_lock);
+    while (1) {
+        // fast path: no writer, so just count ourselves in
+        state = spinlock_data_get(&rw->rw_state);
+        if ((state & RW_WRITER) == 0) {
+            KASSERT((state & RW_READERS) != RW_READERS);
+            if (spinlock_data_cas(&rw->rw_state, state, state + 1) == state)
+                return;
+            continue;
+        }
+        
+        // a writer is in or draining; wait until it's done
+        wchan_lock(rw->rw_readers_wchan);
+        if (spinlock_data_get(&rw->rw_state) & RW_WRITER)
+            wchan_sleep(rw->rw_readers_wchan);
+        else
+            wchan_unlock(rw->rw_readers_wchan);
+    }
 }
 
 void
 rw_rdone(struct rw_mutex *rw)
 {
+    spinlock_data_t state;
+    
     KASSERT(rw != NULL);
     
-    lock_acquire(rw->rw_lock);
-    KASSERT(rw->rw_nreaders > 0);
-    rw->rw_nreaders--;
-    if (rw->rw_nreaders == 0)
-        cv_signal(rw->rw_writer_cv, rw->rw_lock);
-    lock_release(rw->rw_lock);
+    state = spinlock_data_fetchadd(&rw->rw_state, -1);
+    KASSERT((state & RW_READERS) > 0);
+    
+    // the last reader out lets a draining writer in
+    if (state == (RW_WRITER | 1))
+        wchan_wakeone(rw->rw_drain_wchan);
 }
 
 void
 rw_wlock(struct rw_mutex *rw)
 {
+    spinlock_data_t state;
+    
     KASSERT(rw != NULL);
     
-    lock_acquire(rw->rw_lock);
-    while (rw->rw_nreaders > 0 || rw->rw_nwriters > 0)
-        cv_wait(rw->rw_writer_cv, rw->rw_lock);
-    rw->rw_nwriters = 1;
-    lock_release(rw->rw_lock);
+    // exclude other writers
+    lock_acquire(rw->rw_wlock);
+    
+    // keep new readers out; the bit is clear, as we're the only writer
+    state = spinlock_data_fetchadd(&rw->rw_state, RW_WRITER);
+    KASSERT((state & RW_WRITER) == 0);
+    
+    // wait for the readers already in to drain out
+    wchan_lock(rw->rw_drain_wchan);
+    while (spinlock_data_get(&rw->rw_state) != RW_WRITER) {
+        wchan_sleep(rw->rw_drain_wchan);
+        wchan_lock(rw->rw_drain_wchan);
+    }
+    wchan_unlock(rw->rw_drain_wchan);
 }
 
 void
 rw_wdone(struct rw_mutex *rw)
 {
     KASSERT(rw != NULL);
+    KASSERT(lock_do_i_hold(rw->rw_wlock));
+    
+    // nobody else can change the state while the writer bit is set
+    KASSERT(spinlock_data_get(&rw->rw_state) == RW_WRITER);
+    spinlock_data_set(&rw->rw_state, 0);
     
-    lock_acquire(rw->rw_lock);
-    KASSERT(rw->rw_nwriters == 1);
-    rw->rw_nwriters = 0;
-    cv_signal(rw->rw_writer_cv, rw->rw_lock);
-    cv_broadcast(rw->rw_reader_cv, rw->rw_lock);
-    lock_release(rw->rw_lock);
+    lock_release(rw->rw_wlock);
+    wchan_wakeall(rw->rw_readers_wchan);
 }
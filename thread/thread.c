@@ -50,14 +50,40 @@
 #include <mainbus.h>
 #include <vnode.h>
 #include <pid_set.h>
+#include <clock.h>
 
 #include "opt-synchprobs.h"
 #include "opt-roundrobin.h"
+#include "opt-fairshare.h"
 #include "opt-asid.h"
 
+#if OPT_ROUNDROBIN && OPT_FAIRSHARE
+#error "options roundrobin and fairshare are mutually exclusive"
+#endif
+
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/* Run queue length at which a cpu is too busy to wake threads onto. */
+#define WAKE_OVERLOAD 4
+
+/* Whether thread T may run on cpu C. */
+#define THREAD_ALLOWED(t, c) (((t)->t_affinity >> (c)->c_number) & 1)
+
+/*
+ * Fair-share tuning, in units of vruntime. A default-weight thread
+ * gains FS_TICK per hardclock. The running thread is preempted once
+ * it is FS_GRANULARITY ahead of the next in line, and a thread waking
+ * from sleep is placed no further than FS_SLEEPER_CREDIT behind the
+ * cpu's minimum, so a long sleep can't bank a long burst of cpu.
+ */
+#define FS_TICK			1024
+#define FS_GRANULARITY		(2 * FS_TICK)
+#define FS_SLEEPER_CREDIT	(4 * FS_TICK)
+
+/* Vruntime comparison, safe across wraparound. */
+#define FS_BEFORE(a, b) ((int64_t)((a) - (b)) < 0)
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -73,6 +99,18 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Most dead threads each cpu keeps for reuse (see thread_recycle).
+ * Enough to cover a burst of forks without holding much memory.
+ */
+#define THREAD_CACHE_MAX 8
+static unsigned thread_cache_max = THREAD_CACHE_MAX;
+
+/* Used by idle CPUs in thread_switch to pull work from busy ones. */
+static struct thread *thread_steal(void);
+static void thread_idle(void *unused, unsigned long unused2);
+static void thread_kick_tickless(struct cpu *busy);
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -113,26 +151,28 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Initialize the fields of a thread structure, either a new one or one
+ * recycled from the thread cache; everything except the stack.
  */
 static
-struct thread *
-thread_create(const char *name)
+int
+thread_init(struct thread *thread, const char *name)
 {
-	struct thread *thread;
+	size_t len;
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
+	/* Most names fit in the thread; only copy long ones to the heap */
+	len = strlen(name) + 1;
+	if (len <= sizeof(thread->t_namebuf)) {
+		memcpy(thread->t_namebuf, name, len);
+		thread->t_name = thread->t_namebuf;
 	}
-
-	thread->t_name = kstrdup(name);
-	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+	else {
+		thread->t_name = kstrdup(name);
+		if (thread->t_name == NULL) {
+			return ENOMEM;
+		}
 	}
 	
 	thread->t_wchan_name = "NEW";
@@ -141,10 +181,10 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_tid = 0;
     
     
     /* Scheduling fields */
@@ -158,6 +198,18 @@ thread_create(const char *name)
     // its usage behavior.
     thread->t_ntimeslices = 1;
     
+    // Nobody is waiting on it for anything yet
+    thread->t_donated = PRIORITY_NONE;
+    thread->t_heldlocks = NULL;
+    thread->t_waitlock = NULL;
+    
+    // May run anywhere; nobody has woken it yet
+    thread->t_affinity = ~(uint32_t)0;
+    thread->t_lastwaker = -1;
+    
+    thread->t_vruntime = 0;
+    thread->t_weight = FS_WEIGHT_DEFAULT;
+    
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -171,6 +223,30 @@ thread_create(const char *name)
 
 	/* If you add to struct thread, be sure to initialize here */
 
+	return 0;
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	thread = kmalloc(sizeof(*thread));
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	if (thread_init(thread, name)) {
+		kfree(thread);
+		return NULL;
+	}
+	thread->t_stack = NULL;
+
 	return thread;
 }
 
@@ -188,6 +264,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -199,6 +276,7 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies, 1);
+	threadlist_init(&c->c_threadcache, 1);
     
     c->c_orphans = pid_set_create();
     if (c->c_orphans == NULL)
@@ -211,20 +289,32 @@ cpu_create(unsigned hardware_number)
 #endif
     
 	c->c_hardclocks = 0;
+	c->c_idleclocks = 0;
+	c->c_tickless = 0;
+	c->c_ticklesssecs = 0;
+	c->c_ticklessnsecs = 0;
+	c->c_migrations = 0;
+	c->c_switches = 0;
+	c->c_departing = NULL;
 
 	c->c_isidle = false;
 
-#if OPT_ROUNDROBIN
+#if OPT_ROUNDROBIN || OPT_FAIRSHARE
     threadlist_init(&c->c_runqueue, 1);
 #else
 	threadlist_init(&c->c_runqueue, PRIORITY_MAX + 1);
 #endif
 
-	spinlock_init(&c->c_runqueue_lock);
+	spinlock_init_ticket(&c->c_runqueue_lock);
+	spinlock_setname(&c->c_runqueue_lock, "c_runqueue_lock");
+	c->c_minvruntime = 0;
 
-	c->c_ipi_pending = 0;
-	c->c_numshootdown = 0;
-	spinlock_init(&c->c_ipi_lock);
+	spinlock_data_set(&c->c_ipi_pending, 0);
+	for (i = 0; i < IPI_RINGSIZE; i++) {
+		spinlock_data_set(&c->c_shootdown[i].is_seq, i);
+	}
+	spinlock_data_set(&c->c_shootdown_tail, 0);
+	c->c_shootdown_head = 0;
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
 	if (result != 0) {
@@ -255,22 +345,40 @@ cpu_create(unsigned hardware_number)
 	}
 	c->c_curthread->t_cpu = c;
 
+	/*
+	 * A thread to switch to when the current one must leave and
+	 * there's nothing else to run (see thread_switch). It's never
+	 * on a run queue; it runs only when switched to directly.
+	 */
+	snprintf(namebuf, sizeof(namebuf), "<idle #%d>", c->c_number);
+	c->c_idlethread = thread_create(namebuf);
+	if (c->c_idlethread == NULL) {
+		panic("cpu_create: thread_create failed\n");
+	}
+	c->c_idlethread->t_stack = kmalloc(STACK_SIZE);
+	if (c->c_idlethread->t_stack == NULL) {
+		panic("cpu_create: couldn't allocate stack");
+	}
+	thread_checkstack_init(c->c_idlethread);
+	c->c_idlethread->t_cpu = c;
+	c->c_idlethread->t_affinity = (uint32_t)1 << c->c_number;
+	/* it comes out holding the run queue lock, as in thread_fork */
+	c->c_idlethread->t_iplhigh_count++;
+	switchframe_init(c->c_idlethread, thread_idle, NULL, 0);
+
 	cpu_machdep_init(c);
 
 	return c;
 }
 
 /*
- * Destroy a thread.
- *
- * This function cannot be called in the victim thread's own context.
- * Nor can it be called on a running thread.
- *
- * (Freeing the stack you're actually using to run is ... inadvisable.)
+ * Check a dead thread is cleaned up and release what it holds, apart
+ * from its structure and stack, which thread_destroy frees and
+ * thread_recycle keeps.
  */
 static
 void
-thread_destroy(struct thread *thread)
+thread_cleanup(struct thread *thread)
 {
 	KASSERT(thread != curthread);
 	KASSERT(thread->t_state != S_RUN);
@@ -288,24 +396,144 @@ thread_destroy(struct thread *thread)
 	/* Process, cleaned up in thread_exit */
 	KASSERT(thread->t_proc == NULL);
 
+	/* Locks, all released before exiting */
+	KASSERT(thread->t_heldlocks == NULL);
+	KASSERT(thread->t_waitlock == NULL);
+
 	/* Thread subsystem fields */
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+
+	if (thread->t_name != thread->t_namebuf) {
+		kfree(thread->t_name);
+		thread->t_name = thread->t_namebuf;
+	}
+}
+
+/*
+ * Destroy a thread.
+ *
+ * This function cannot be called in the victim thread's own context.
+ * Nor can it be called on a running thread.
+ *
+ * (Freeing the stack you're actually using to run is ... inadvisable.)
+ */
+static
+void
+thread_destroy(struct thread *thread)
+{
+	thread_cleanup(thread);
+
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
-	threadlistnode_cleanup(&thread->t_listnode);
-	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread->t_name);
 	kfree(thread);
 }
 
+/*
+ * Put a dead thread in this cpu's thread cache, stack and all, for
+ * thread_fork to reuse, unless the cache is full. Interrupts must be
+ * off, to keep us on this cpu.
+ */
+static
+void
+thread_recycle(struct thread *thread)
+{
+	KASSERT(curthread->t_curspl > 0);
+
+	if (thread->t_stack == NULL ||
+	    curcpu->c_threadcache.tl_count >= thread_cache_max) {
+		thread_destroy(thread);
+		return;
+	}
+
+	thread_cleanup(thread);
+	thread_checkstack(thread);
+	thread->t_wchan_name = "CACHED";
+	threadlist_addhead(&curcpu->c_threadcache, thread);
+}
+
+/*
+ * Free the threads in this cpu's thread cache beyond the current
+ * limit. They were cleaned up when cached, so only the stack and
+ * structure are left.
+ */
+static
+void
+thread_trimcache(void)
+{
+	struct thread *thread;
+	int spl;
+
+	spl = splhigh();
+	while (curcpu->c_threadcache.tl_count > thread_cache_max) {
+		thread = threadlist_remtail(&curcpu->c_threadcache);
+		kfree(thread->t_stack);
+		kfree(thread);
+	}
+	splx(spl);
+}
+
+/*
+ * Take a thread from this cpu's thread cache and set it up afresh,
+ * with name NAME. Returns NULL if the cache is empty. The stack is
+ * reused as is; its guard band was checked when it was cached.
+ */
+static
+struct thread *
+thread_reuse(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	/* The limit may have been lowered since this cpu last looked. */
+	thread_trimcache();
+
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	splx(spl);
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	if (thread_init(thread, name)) {
+		/*
+		 * Only the name copy can fail, before anything else is
+		 * set up, and the rest was cleaned up when the thread
+		 * was cached; so don't go through thread_destroy.
+		 */
+		kfree(thread->t_stack);
+		kfree(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+/*
+ * Set the most threads each cpu caches; 0 disables the cache. Threads
+ * cached beyond the new limit are freed now on this cpu, and on each
+ * other cpu the next time it forks, before it could reuse them.
+ * Returns the old limit.
+ */
+unsigned
+thread_setcachelimit(unsigned limit)
+{
+	unsigned old;
+
+	old = thread_cache_max;
+	thread_cache_max = limit;
+	thread_trimcache();
+	return old;
+}
+
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
- * Also cleans up any orphan zombie processes.
+ * need to be destroyed, or recycled for reuse.)
+ * Also arranges for orphan zombie processes to be cleaned up.
  * The list of zombies is per-cpu.
  */
 static
@@ -314,12 +542,12 @@ exorcise(void)
 {
 	struct thread *z;
 
-    pid_set_map(curcpu->c_orphans, process_check_destroy);
+    process_reap_orphans();
     
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		thread_recycle(z);
 	}
     
 }
@@ -347,6 +575,7 @@ thread_panic(void)
 	 * risk that it might not be quite atomic.
 	 */
 	curcpu->c_runqueue.tl_count = 0;
+	curcpu->c_runqueue.tl_bitmap = 0;
     for (int i = 0; i < curcpu->c_runqueue.tl_nprior; i++) {
         curcpu->c_runqueue.tl_head[i].tln_next = NULL;
         curcpu->c_runqueue.tl_tail[i].tln_prev = NULL;
@@ -468,17 +697,118 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Choose the cpu to wake TARGET on.
+ *
+ * Stay on the cpu it last ran on unless that cpu is overloaded or
+ * not in its affinity mask. If the waking cpu also woke it last
+ * time, the two are likely a producer/consumer pair, so pull it over
+ * to the waker as long as the waker is no busier.
+ *
+ * The run queue lengths are read unlocked; they are only a hint.
+ */
+static
+struct cpu *
+thread_wake_cpu(struct thread *target)
+{
+	struct cpu *last, *waker, *best, *c;
+	unsigned i, numcpus;
+	bool paired;
+
+	last = target->t_cpu;
+	waker = curcpu->c_self;
+	paired = (target->t_lastwaker == (int)waker->c_number);
+	target->t_lastwaker = waker->c_number;
+
+	if (paired && waker != last && THREAD_ALLOWED(target, waker) &&
+	    waker->c_runqueue.tl_count <= last->c_runqueue.tl_count) {
+		return waker;
+	}
+	if (THREAD_ALLOWED(target, last) &&
+	    last->c_runqueue.tl_count < WAKE_OVERLOAD) {
+		return last;
+	}
+
+	/* Otherwise, the least loaded allowed cpu; ties keep it put. */
+	best = THREAD_ALLOWED(target, last) ? last : NULL;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (THREAD_ALLOWED(target, c) &&
+		    (best == NULL ||
+		     c->c_runqueue.tl_count < best->c_runqueue.tl_count)) {
+			best = c;
+		}
+	}
+	KASSERT(best != NULL);
+	return best;
+}
+
+/*
+ * Put T on C's run queue. The caller holds C's run queue lock.
+ */
+static
+void
+thread_enqueue(struct cpu *c, struct thread *t)
+{
+#if OPT_FAIRSHARE
+	threadlist_addsorted(&c->c_runqueue, t);
+#else
+	threadlist_addtail(&c->c_runqueue, t);
+#endif
+}
+
+#if OPT_FAIRSHARE
+/*
+ * Move T's vruntime from cpu FROM's frame to cpu TO's, keeping its
+ * lead or lag on the cpu's minimum. Each cpu's c_minvruntime is only
+ * changed by that cpu, holding its run queue lock, so the caller must
+ * be on one of the two cpus with interrupts off and hold the other's
+ * run queue lock.
+ */
+static
+void
+thread_fs_rebase(struct thread *t, struct cpu *from, struct cpu *to)
+{
+	t->t_vruntime = t->t_vruntime - from->c_minvruntime
+		+ to->c_minvruntime;
+}
+
+/*
+ * Limit the credit T banked while asleep to FS_SLEEPER_CREDIT, as it
+ * wakes on C. The caller holds C's run queue lock.
+ */
+static
+void
+thread_fs_wakeclamp(struct thread *t, struct cpu *c)
+{
+	uint64_t floor;
+
+	floor = c->c_minvruntime - FS_SLEEPER_CREDIT;
+	if (FS_BEFORE(t->t_vruntime, floor)) {
+		t->t_vruntime = floor;
+	}
+}
+#endif
+
 /*
  * Make a thread runnable.
  *
  * targetcpu might be curcpu; it might not be, too.
+ *
+ * Unless the caller already holds the target cpu's run queue lock
+ * (the thread is yielding), the thread may be moved to another cpu
+ * chosen by thread_wake_cpu.
  */
 static
 void
 thread_make_runnable(struct thread *target, bool already_have_lock)
 {
-	struct cpu *targetcpu;
+	struct cpu *targetcpu, *newcpu;
 	bool isidle;
+#if OPT_FAIRSHARE
+	uint64_t lag;
+#endif
 
 	/* Lock the run queue of the target thread's cpu. */
 	targetcpu = target->t_cpu;
@@ -488,11 +818,36 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
 	}
 	else {
+		newcpu = thread_wake_cpu(target);
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		/*
+		 * The old cpu holds its run queue lock from the moment
+		 * the thread goes to sleep until it has switched off
+		 * the thread's stack, except while idling with the
+		 * thread still as its curthread. So if we hold the lock
+		 * and the thread isn't its curthread, the thread is
+		 * safe to move.
+		 */
+		if (newcpu != targetcpu && targetcpu->c_curthread != target) {
+#if OPT_FAIRSHARE
+			lag = target->t_vruntime - targetcpu->c_minvruntime;
+#endif
+			spinlock_release(&targetcpu->c_runqueue_lock);
+			target->t_cpu = newcpu;
+			targetcpu = newcpu;
+			spinlock_acquire(&targetcpu->c_runqueue_lock);
+#if OPT_FAIRSHARE
+			target->t_vruntime = targetcpu->c_minvruntime + lag;
+#endif
+			curcpu->c_migrations++;
+		}
+#if OPT_FAIRSHARE
+		thread_fs_wakeclamp(target, targetcpu);
+#endif
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	thread_enqueue(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -500,12 +855,139 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else {
+		thread_kick_tickless(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
 	}
 }
 
+/*
+ * One pass of thread_make_runnable_list: take the threads off LIST a
+ * cpu at a time, by the cpu each last ran on, and with that cpu's run
+ * queue locked, queue them there. If MOVED isn't null, threads that
+ * should wake on some other cpu are instead pointed at it and put on
+ * MOVED, for a second pass; their vruntime is kept relative to the
+ * old cpu's minimum until then.
+ */
+static
+void
+thread_make_runnable_pass(struct threadlist *list, struct threadlist *moved)
+{
+	struct thread *target;
+	struct cpu *targetcpu, *newcpu;
+	unsigned i, n;
+	bool queued;
+
+	while ((target = threadlist_peekhead(list)) != NULL) {
+		targetcpu = target->t_cpu;
+		queued = false;
+
+		spinlock_acquire(&targetcpu->c_runqueue_lock);
+		n = list->tl_count;
+		for (i=0; i<n; i++) {
+			target = threadlist_remhead(list);
+			if (target->t_cpu != targetcpu) {
+				threadlist_addtail(list, target);
+				continue;
+			}
+			if (moved != NULL) {
+				/* as in thread_make_runnable */
+				newcpu = thread_wake_cpu(target);
+				if (newcpu != targetcpu &&
+				    targetcpu->c_curthread != target) {
+#if OPT_FAIRSHARE
+					target->t_vruntime -=
+						targetcpu->c_minvruntime;
+#endif
+					target->t_cpu = newcpu;
+					curcpu->c_migrations++;
+					threadlist_addtail(moved, target);
+					continue;
+				}
+			}
+			else {
+#if OPT_FAIRSHARE
+				target->t_vruntime += targetcpu->c_minvruntime;
+#endif
+			}
+#if OPT_FAIRSHARE
+			thread_fs_wakeclamp(target, targetcpu);
+#endif
+			thread_enqueue(targetcpu, target);
+			queued = true;
+		}
+		if (queued && targetcpu->c_isidle) {
+			/* one interrupt unidles it for all of them */
+			ipi_send(targetcpu, IPI_UNIDLE);
+		}
+		else if (queued) {
+			thread_kick_tickless(targetcpu);
+		}
+		spinlock_release(&targetcpu->c_runqueue_lock);
+	}
+}
+
+/*
+ * Make all the threads on LIST runnable, leaving it empty. This is
+ * thread_make_runnable for each, but batched by cpu: each run queue is
+ * locked once per pass rather than once per thread, and an idle cpu
+ * gets at most one IPI per pass. There are two passes, because where
+ * a thread should wake is decided under the lock of the cpu it last
+ * ran on, and it may then need queueing on another.
+ */
+static
+void
+thread_make_runnable_list(struct threadlist *list)
+{
+	struct threadlist moved;
+
+	threadlist_init(&moved, 1);
+	thread_make_runnable_pass(list, &moved);
+	thread_make_runnable_pass(&moved, NULL);
+	threadlist_cleanup(&moved);
+}
+
+/*
+ * Hand over the thread we just switched away from, if it is no longer
+ * allowed on this cpu (see thread_switch). Called by the thread now
+ * running, once the run queue is unlocked; by then the departing
+ * thread is off this cpu's stack and can go anywhere.
+ */
+static
+void
+thread_depart(void)
+{
+	struct thread *t;
+
+	t = curcpu->c_departing;
+	if (t != NULL) {
+		curcpu->c_departing = NULL;
+		thread_make_runnable(t, false);
+	}
+}
+
+/*
+ * Body of each cpu's idle thread. Each time it is switched to, it has
+ * already handed over the thread that left (see thread_startup and
+ * the end of thread_switch); it then goes idle like any yielding
+ * thread with nothing to do, and stays parked once something else
+ * runs.
+ */
+static
+void
+thread_idle(void *unused, unsigned long unused2)
+{
+	(void)unused;
+	(void)unused2;
+
+	while (1) {
+		thread_yield();
+	}
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -525,18 +1007,22 @@ thread_fork(const char *name,
 {
 	struct thread *newthread;
 
-	newthread = thread_create(name);
+	/* Reuse a dead thread and its stack if we can */
+	newthread = thread_reuse(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -544,6 +1030,9 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_affinity = curthread->t_affinity;
+	newthread->t_vruntime = curthread->t_vruntime;
+	newthread->t_weight = curthread->t_weight;
 
 	/* VM fields */
 	/* do not clone address space -- let caller decide on that */
@@ -619,8 +1108,13 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * Micro-optimization: if nothing to do, just return. But a
+	 * thread that may no longer run here must go even so, and
+	 * the idle thread yields only to go idle.
+	 */
+	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue) &&
+	    THREAD_ALLOWED(cur, curcpu) && cur != curcpu->c_idlethread) {
 		spinlock_release(&curcpu->c_runqueue_lock);
         cur->t_ntimeslices = 1 << cur->t_priority;
 		splx(spl);
@@ -632,7 +1126,34 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
-		thread_make_runnable(cur, true /*have lock*/);
+		if (cur == curcpu->c_idlethread) {
+			/* not queued anywhere; it's switched to directly */
+			break;
+		}
+#if OPT_FAIRSHARE
+		/*
+		 * Yielding means letting someone else run, so go
+		 * behind at least the next thread in line even if we
+		 * are still owed cpu time.
+		 */
+		next = threadlist_peekhead(&curcpu->c_runqueue);
+		if (next != NULL && FS_BEFORE(cur->t_vruntime, next->t_vruntime)) {
+			cur->t_vruntime = next->t_vruntime;
+		}
+#endif
+		if (THREAD_ALLOWED(cur, curcpu)) {
+			thread_make_runnable(cur, true /*have lock*/);
+		}
+		else {
+			/*
+			 * Not allowed here any more. We can't put it on
+			 * another cpu's run queue while we're still on
+			 * its stack, so the next thread hands it over
+			 * (see thread_depart). If the run queue is
+			 * empty, that is the idle thread (see below).
+			 */
+			curcpu->c_departing = cur;
+		}
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
@@ -676,18 +1197,52 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	 * lock to look at it, this should not be visible or matter.
 	 */
 
+	/*
+	 * If the current thread is leaving and there's nothing else to
+	 * run, switch to the idle thread, which sends it on its way
+	 * and then idles on its own stack instead of the leaver's.
+	 */
+	if (curcpu->c_departing == cur &&
+	    threadlist_isempty(&curcpu->c_runqueue)) {
+		next = curcpu->c_idlethread;
+		goto gotnext;
+	}
+
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
+			/*
+			 * Nothing to run here; before idling, try to
+			 * steal work from the busiest other cpu. Our
+			 * own run queue is unlocked while we do, so we
+			 * never hold two run queue locks at once.
+			 */
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				/*
+				 * Stop the clock until the next
+				 * callout; any interrupt restarts it.
+				 */
+				hardclock_idle();
+				cpu_idle();
+				hardclock_resume();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+#if OPT_FAIRSHARE
+	/* Everything left on the run queue is behind next. */
+	if (FS_BEFORE(curcpu->c_minvruntime, next->t_vruntime)) {
+		curcpu->c_minvruntime = next->t_vruntime;
+	}
+#endif
+ gotnext:
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -700,6 +1255,7 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
     next->t_ntimeslices = 1 << next->t_priority;
 	curcpu->c_curthread = next;
 	curthread = next;
+	curcpu->c_switches++;
 
 	/* do the switch (in assembler in switch.S) */
 	switchframe_switch(&cur->t_context, &next->t_context);
@@ -758,6 +1314,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Unlock the run queue. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send away the thread we switched from, if it is leaving. */
+	thread_depart();
+
 	/* If we have an address space, activate it in the MMU. */
 	if (cur->t_proc != NULL && cur->t_proc->ps_addrspace != NULL) {
 		as_activate(cur->t_proc->ps_addrspace);
@@ -793,6 +1352,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Release the runqueue lock acquired in thread_switch. */
 	spinlock_release(&curcpu->c_runqueue_lock);
 
+	/* Send away the thread we switched from, if it is leaving. */
+	thread_depart();
+
 	/* If we have a user process, activate its address space in the MMU. */
 	if (cur->t_proc != NULL && cur->t_proc->ps_addrspace != NULL) {
 		as_activate(cur->t_proc->ps_addrspace);
@@ -827,7 +1389,7 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
  *
  * The parts of the thread structure we don't actually need to run
  * should be cleaned up right away. The rest has to wait until
- * thread_destroy is called from exorcise().
+ * exorcise() destroys or recycles it.
  *
  * Does not return.
  */
@@ -879,11 +1441,111 @@ thread_yield(void)
 void
 schedule(void)
 {
+#if OPT_FAIRSHARE
+	/*
+	 * Nothing to do: a thread kept waiting falls behind on
+	 * vruntime and so works its way to the front by itself.
+	 */
+#else
 	/*
      * Randomly choose a lower-priority thread and give it
      * processor time, so as to prevent starvation.
      */
     threadlist_shuffle(&curthread->t_cpu->c_runqueue);
+#endif
+}
+
+/*
+ * Work stealing.
+ *
+ * Called by an idle cpu from thread_switch, with its own run queue
+ * unlocked. Takes the thread at the tail of the busiest other cpu's
+ * run queue and returns it, now belonging to the current cpu, or
+ * returns NULL if every other run queue is empty.
+ *
+ * The busiest cpu is picked from unlocked reads of the queue
+ * lengths; that is only a hint, so the count is checked again once
+ * the victim's queue is locked.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	unsigned i, numcpus, count, maxcount;
+	struct cpu *c, *victim;
+	struct thread *t;
+
+	victim = NULL;
+	maxcount = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		count = c->c_runqueue.tl_count;
+		if (count > maxcount) {
+			maxcount = count;
+			victim = c;
+		}
+	}
+	if (victim == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&victim->c_runqueue_lock);
+	t = threadlist_remtail(&victim->c_runqueue);
+	if (t != NULL &&
+	    (t == victim->c_curthread || !THREAD_ALLOWED(t, curcpu))) {
+		/*
+		 * Either the thread is pinned away from us, or the
+		 * victim is idle and its own curthread was just woken
+		 * onto its run queue (see the comment in
+		 * thread_consider_migration), so that thread is still
+		 * on the victim's stack. Leave it be.
+		 */
+		thread_enqueue(victim, t);
+		t = NULL;
+	}
+	if (t != NULL) {
+#if OPT_FAIRSHARE
+		thread_fs_rebase(t, victim, curcpu->c_self);
+#endif
+		t->t_cpu = curcpu->c_self;
+		curcpu->c_migrations++;
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      t->t_name, victim->c_number, curcpu->c_number);
+	}
+	spinlock_release(&victim->c_runqueue_lock);
+
+	return t;
+}
+
+/*
+ * Called after queueing work on BUSY, which isn't idle. Idle cpus
+ * steal work only when they wake, and one that stopped its clock in
+ * hardclock_idle may not wake for a long while, so interrupt one of
+ * those; it then steals from BUSY or whoever is busiest. Idle cpus
+ * that are still ticking will look on their next hardclock anyway.
+ *
+ * c_isidle and c_tickless are read without the other cpus' locks;
+ * they are only a hint, and a missed or extra interrupt is harmless.
+ */
+static
+void
+thread_kick_tickless(struct cpu *busy)
+{
+	unsigned i, numcpus;
+	struct cpu *c;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != busy && c->c_isidle && c->c_tickless != 0) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
 }
 
 /*
@@ -893,6 +1555,11 @@ schedule(void)
  * CPU is busy and other CPUs are idle, or less busy, it should move
  * threads across to those other other CPUs.
  *
+ * Idle cpus now pull work for themselves with thread_steal(), so this
+ * is only a fallback for imbalance between cpus that are all busy.
+ * It runs less often, and it counts threads without taking the other
+ * cpus' run queue locks.
+ *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
  * which is fairly slow. The tradeoff between this performance loss
@@ -912,16 +1579,18 @@ thread_consider_migration(void)
 	struct threadlist victims;
 	struct thread *t;
 
-	my_count = total_count = 0;
+	/* nothing to give away */
+	my_count = curcpu->c_runqueue.tl_count;
+	if (my_count < 2) {
+		return;
+	}
+
+	/* unlocked reads: the counts are only a hint */
+	total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
 		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
 
 	one_share = DIVROUNDUP(total_count, numcpus);
@@ -934,6 +1603,11 @@ thread_consider_migration(void)
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 	for (i=0; i<to_send; i++) {
 		t = threadlist_remtail(&curcpu->c_runqueue);
+		if (t == NULL) {
+			/* someone stole from us since we counted */
+			to_send = i;
+			break;
+		}
 		threadlist_addhead(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
@@ -974,8 +1648,19 @@ thread_consider_migration(void)
 				continue;
 			}
 
+			/* Likewise for threads that may not run on c. */
+			if (!THREAD_ALLOWED(t, c)) {
+				threadlist_addtail(&victims, t);
+				to_send--;
+				continue;
+			}
+
+#if OPT_FAIRSHARE
+			thread_fs_rebase(t, curcpu->c_self, c);
+#endif
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			curcpu->c_migrations++;
+			thread_enqueue(c, t);
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
@@ -999,7 +1684,7 @@ thread_consider_migration(void)
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			thread_enqueue(curcpu->c_self, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -1008,6 +1693,153 @@ thread_consider_migration(void)
 	threadlist_cleanup(&victims);
 }
 
+/*
+ * Set T's donated priority. If T is waiting on its cpu's run queue,
+ * move it to the queue for its new effective priority; otherwise the
+ * new priority takes effect the next time it is queued. If T is
+ * moving between cpus it isn't on the queue we lock, which is fine.
+ */
+void
+thread_setdonated(struct thread *t, unsigned prio)
+{
+	struct cpu *c;
+	struct threadlist *rq;
+	int queue;
+
+	KASSERT(prio <= PRIORITY_NONE);
+
+	t->t_donated = prio;
+
+	c = t->t_cpu;
+	if (t == curthread || c == NULL) {
+		return;
+	}
+	rq = &c->c_runqueue;
+	if (rq->tl_nprior == 1) {
+		/* only one queue; priority doesn't decide the order */
+		return;
+	}
+
+	spinlock_acquire(&c->c_runqueue_lock);
+	if (t->t_listnode.tln_list == rq) {
+		queue = (THREAD_PRIORITY(t) * rq->tl_nprior) /
+			(PRIORITY_MAX + 1);
+		if (queue != t->t_listnode.tln_queue) {
+			threadlist_remove(rq, t);
+			thread_enqueue(c, t);
+		}
+	}
+	spinlock_release(&c->c_runqueue_lock);
+}
+
+int
+thread_setaffinity(uint32_t mask)
+{
+	unsigned numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	if (numcpus < 32) {
+		mask &= ((uint32_t)1 << numcpus) - 1;
+	}
+	if (mask == 0) {
+		return EINVAL;
+	}
+
+	curthread->t_affinity = mask;
+	if (!THREAD_ALLOWED(curthread, curcpu)) {
+		/* Leave now; thread_switch makes sure we go. */
+		thread_yield();
+	}
+	return 0;
+}
+
+int
+thread_setweight(unsigned weight)
+{
+	if (weight < FS_WEIGHT_MIN || weight > FS_WEIGHT_MAX) {
+		return EINVAL;
+	}
+	/* we're not on a run queue, so no lock is needed */
+	curthread->t_weight = weight;
+	return 0;
+}
+
+#if OPT_FAIRSHARE
+/*
+ * Fair-share accounting, called from hardclock(). The current thread
+ * is charged for the tick, the cpu's minimum vruntime moves up to
+ * whichever of it and the head of the run queue is further behind,
+ * and the thread is preempted once it is FS_GRANULARITY ahead of the
+ * head.
+ */
+void
+thread_fairshare_tick(void)
+{
+	struct thread *cur, *head;
+	uint64_t vmin;
+	bool preempt;
+
+	/* Idling isn't the sleeping curthread's fault. */
+	if (curcpu->c_isidle) {
+		return;
+	}
+
+	cur = curthread;
+	cur->t_vruntime += FS_TICK * FS_WEIGHT_DEFAULT / cur->t_weight;
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	head = threadlist_peekhead(&curcpu->c_runqueue);
+	vmin = cur->t_vruntime;
+	if (head != NULL && FS_BEFORE(head->t_vruntime, vmin)) {
+		vmin = head->t_vruntime;
+	}
+	if (FS_BEFORE(curcpu->c_minvruntime, vmin)) {
+		curcpu->c_minvruntime = vmin;
+	}
+	preempt = head != NULL &&
+		FS_BEFORE(head->t_vruntime + FS_GRANULARITY, cur->t_vruntime);
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	if (preempt) {
+		thread_yield();
+	}
+}
+#endif
+
+unsigned
+thread_numcpus(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+/*
+ * Print per-cpu scheduler statistics. Rates are averaged since boot;
+ * the counters are read without locking.
+ */
+void
+thread_printstats(void)
+{
+	unsigned i, numcpus, secs, total, switches;
+	struct cpu *c;
+
+	total = switches = 0;
+	numcpus = cpuarray_num(&allcpus);
+	kprintf("cpu  runnable  migrations  migrations/sec  "
+		"idle ticks skipped    switches\n");
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		secs = c->c_hardclocks / HZ;
+		kprintf("%3u  %8u  %10u  %14u  %18u  %10u\n", c->c_number,
+			c->c_runqueue.tl_count, c->c_migrations,
+			secs ? c->c_migrations / secs : 0, c->c_idleclocks,
+			c->c_switches);
+		total += c->c_migrations;
+		switches += c->c_switches;
+	}
+	kprintf("total migrations: %u\n", total);
+	kprintf("total context switches: %u\n", switches);
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -1140,17 +1972,52 @@ wchan_wakeall(struct wchan *wc)
 	spinlock_release(&wc->wc_lock);
 
 	/*
-	 * We could conceivably sort by cpu first to cause fewer lock
-	 * ops and fewer IPIs, but for now at least don't bother. Just
-	 * make each thread runnable.
+	 * Make them runnable a cpu at a time, for fewer run queue lock
+	 * operations and fewer IPIs.
 	 */
-	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
-	}
+	thread_make_runnable_list(&list);
 
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Move up to MAX threads from one wait channel to another.
+ */
+static
+unsigned
+wchan_move(struct wchan *from, struct wchan *to, unsigned max)
+{
+	struct thread *target;
+	unsigned n = 0;
+
+	KASSERT(from != to);
+
+	spinlock_acquire(&from->wc_lock);
+	spinlock_acquire(&to->wc_lock);
+	while (n < max &&
+	       (target = threadlist_remhead(&from->wc_threads)) != NULL) {
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+		n++;
+	}
+	spinlock_release(&to->wc_lock);
+	spinlock_release(&from->wc_lock);
+
+	return n;
+}
+
+unsigned
+wchan_moveone(struct wchan *from, struct wchan *to)
+{
+	return wchan_move(from, to, 1);
+}
+
+unsigned
+wchan_moveall(struct wchan *from, struct wchan *to)
+{
+	return wchan_move(from, to, (unsigned)-1);
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1175,16 +2042,23 @@ wchan_isempty(struct wchan *wc)
 
 /*
  * Send an IPI (inter-processor interrupt) to the specified CPU.
+ *
+ * The pending bit is set before the interrupt is raised, and the
+ * target clears the interrupt before taking its bits, so no IPI is
+ * lost. Senders never wait for one another.
  */
 void
 ipi_send(struct cpu *target, int code)
 {
+	spinlock_data_t old;
+
 	KASSERT(code >= 0 && code < 32);
 
-	spinlock_acquire(&target->c_ipi_lock);
-	target->c_ipi_pending |= (uint32_t)1 << code;
+	do {
+		old = spinlock_data_get(&target->c_ipi_pending);
+	} while (spinlock_data_cas(&target->c_ipi_pending, old,
+				   old | ((uint32_t)1 << code)) != old);
 	mainbus_send_ipi(target);
-	spinlock_release(&target->c_ipi_lock);
 }
 
 void
@@ -1201,57 +2075,87 @@ ipi_broadcast(int code)
 	}
 }
 
+/*
+ * Put a shootdown in TARGET's ring and interrupt it. Claim the slot
+ * at the tail by advancing the tail past it; if another sender got
+ * there first, try the next. Then fill the slot and publish it.
+ *
+ * Claiming and filling happen at splhigh, so we can't be preempted
+ * in between and hold up the target, which drains the ring in order.
+ * Waiting for a full ring happens with interrupts on, so two cpus
+ * filling each other's rings still drain their own.
+ */
 static
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	int n;
-
-	spinlock_acquire(&target->c_ipi_lock);
+	struct ipi_slot *slot;
+	spinlock_data_t pos, seq;
+	int spl;
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	while (1) {
+		spl = splhigh();
+		pos = spinlock_data_get(&target->c_shootdown_tail);
+		slot = &target->c_shootdown[pos % IPI_RINGSIZE];
+		seq = spinlock_data_get(&slot->is_seq);
+		/*
+		 * If SEQ is behind POS the ring is full; the target
+		 * empties it at interrupt level, so just go around
+		 * again until it has.
+		 */
+		if (seq == pos &&
+		    spinlock_data_cas(&target->c_shootdown_tail,
+				      pos, pos + 1) == pos) {
+			break;
+		}
+		splx(spl);
 	}
 
-	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
+	slot->is_ts = *mapping;
+	spinlock_data_fetchadd(&slot->is_seq, 1);
+	splx(spl);
 
-	spinlock_release(&target->c_ipi_lock);
+	ipi_send(target, IPI_TLBSHOOTDOWN);
 }
 
 void
 ipi_tlbbroadcast(const struct tlbshootdown *mapping)
 {
-    unsigned i, ncpus;
-	struct cpu *c;
+    unsigned i, ncpus, nsent;
+	struct cpu *c, *self;
     
+    // We can migrate while sending, so count the cpus actually
+    // sent to: expect them all up front, so no early finisher
+    // can take the count to zero, then take back the rest.
     ncpus = cpuarray_num(&allcpus);
+    self = curcpu->c_self;
+    nsent = 0;
+    ts_expect(mapping, ncpus);
     // first, send all the shootdowns...
 	for (i=0; i < ncpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		if (c != curcpu->c_self) {
+		if (c != self) {
 			ipi_tlbshootdown(c, mapping);
+			nsent++;
 		}
 	}
+    ts_unexpect(mapping, ncpus - nsent);
     
     // ...then, wait for them all to complete
-    for (i = 0; i < ncpus - 1; i++)
-        ts_wait(mapping);
+    ts_wait(mapping);
 }
 
 void
 interprocessor_interrupt(void)
 {
-	uint32_t bits;
-	int i;
+	struct ipi_slot *slot;
+	spinlock_data_t bits;
+	unsigned head;
 
-	spinlock_acquire(&curcpu->c_ipi_lock);
-	bits = curcpu->c_ipi_pending;
+	/* Take all the pending bits at once. */
+	do {
+		bits = spinlock_data_get(&curcpu->c_ipi_pending);
+	} while (spinlock_data_cas(&curcpu->c_ipi_pending, bits, 0) != bits);
 
 	if (bits & (1U << IPI_PANIC)) {
 		/* panic on another cpu - just stop dead */
@@ -1275,17 +2179,23 @@ interprocessor_interrupt(void)
 		 */
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
-		if (curcpu->c_numshootdown == TLBSHOOTDOWN_ALL) {
-			vm_tlbshootdown_all();
-		}
-		else {
-			for (i=0; i<curcpu->c_numshootdown; i++) {
-				vm_tlbshootdown(&curcpu->c_shootdown[i]);
+		/*
+		 * Do the published shootdowns in order, freeing each
+		 * slot for the sender one lap on. Stop at a slot that
+		 * is claimed but not yet filled in; its sender
+		 * interrupts us again once it is.
+		 */
+		head = curcpu->c_shootdown_head;
+		while (1) {
+			slot = &curcpu->c_shootdown[head % IPI_RINGSIZE];
+			if (spinlock_data_get(&slot->is_seq) != head + 1) {
+				break;
 			}
+			vm_tlbshootdown(&slot->is_ts);
+			spinlock_data_fetchadd(&slot->is_seq,
+					       IPI_RINGSIZE - 1);
+			head++;
 		}
-		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_head = head;
 	}
-
-	curcpu->c_ipi_pending = 0;
-	spinlock_release(&curcpu->c_ipi_lock);
 }
@@ -45,6 +45,8 @@ threadlistnode_init(struct threadlistnode *tln, struct thread *t)
 	tln->tln_next = NULL;
 	tln->tln_prev = NULL;
 	tln->tln_self = t;
+	tln->tln_list = NULL;
+	tln->tln_queue = 0;
 }
 
 void
@@ -55,6 +57,7 @@ threadlistnode_cleanup(struct threadlistnode *tln)
 	KASSERT(tln->tln_next == NULL);
 	KASSERT(tln->tln_prev == NULL);
 	KASSERT(tln->tln_self != NULL);
+	KASSERT(tln->tln_list == NULL);
 }
 
 void
@@ -75,6 +78,7 @@ threadlist_init(struct threadlist *tl, int nprior)
         tl->tl_nperqueue[i] = 0;
     }
     tl->tl_nprior = nprior;
+    tl->tl_bitmap = 0;
 	tl->tl_count = 0;
 }
 
@@ -93,6 +97,7 @@ threadlist_cleanup(struct threadlist *tl)
     }
 	KASSERT(threadlist_isempty(tl));
 	KASSERT(tl->tl_count == 0);
+	KASSERT(tl->tl_bitmap == 0);
 }
 
 bool
@@ -161,6 +166,78 @@ threadlist_removenode(struct threadlistnode *tln)
 	tln->tln_next->tln_prev = tln->tln_prev;
 	tln->tln_prev = NULL;
 	tln->tln_next = NULL;
+	tln->tln_list = NULL;
+}
+
+/*
+ * Index of the lowest/highest set bit in a nonzero word. The MIPS-I
+ * processor has no count-leading-zeros instruction, so isolate the
+ * bit and look it up by de Bruijn multiplication: multiplying by
+ * 0x077cb531 puts a distinct 5-bit pattern in the top bits for each
+ * power of two.
+ */
+static const unsigned char threadlist_debruijn[32] = {
+	0, 1, 28, 2, 29, 14, 24, 3, 30, 22, 20, 15, 25, 17, 4, 8,
+	31, 27, 13, 23, 21, 19, 16, 7, 26, 12, 18, 6, 11, 5, 10, 9,
+};
+
+static
+inline
+unsigned
+threadlist_bitindex(uint32_t bit)
+{
+	return threadlist_debruijn[(uint32_t)(bit * 0x077cb531U) >> 27];
+}
+
+static
+inline
+unsigned
+threadlist_lowbit(uint32_t x)
+{
+	DEBUGASSERT(x != 0);
+	/* x & -x isolates the lowest set bit */
+	return threadlist_bitindex(x & -x);
+}
+
+static
+inline
+unsigned
+threadlist_highbit(uint32_t x)
+{
+	DEBUGASSERT(x != 0);
+	/* set every bit below the highest, then drop all but it */
+	x |= x >> 1;
+	x |= x >> 2;
+	x |= x >> 4;
+	x |= x >> 8;
+	x |= x >> 16;
+	return threadlist_bitindex(x ^ (x >> 1));
+}
+
+/*
+ * Count a thread in or out of queue I, keeping tl_bitmap in step.
+ * Adding also records in the thread where it was put. Doesn't update
+ * tl_count.
+ */
+static
+void
+threadlist_queue_add(struct threadlist *tl, struct thread *t, int i)
+{
+	t->t_listnode.tln_list = tl;
+	t->t_listnode.tln_queue = i;
+	if (tl->tl_nperqueue[i]++ == 0) {
+		tl->tl_bitmap |= (uint32_t)1 << i;
+	}
+}
+
+static
+void
+threadlist_queue_rem(struct threadlist *tl, int i)
+{
+	DEBUGASSERT(tl->tl_nperqueue[i] > 0);
+	if (--tl->tl_nperqueue[i] == 0) {
+		tl->tl_bitmap &= ~((uint32_t)1 << i);
+	}
 }
 
 ////////////////////////////////////////////////////////////
@@ -174,12 +251,13 @@ threadlist_addhead(struct threadlist *tl, struct thread *t)
 	DEBUGASSERT(tl != NULL);
 	DEBUGASSERT(t != NULL);
 
-    int priority = t->t_priority;
+    // queue by effective priority, which includes any donation
+    int priority = THREAD_PRIORITY(t);
     // calculate correct queue on tl
     priority = (priority * tl->tl_nprior) / (PRIORITY_MAX + 1);
     
 	threadlist_insertafternode(&tl->tl_head[priority], t);
-	tl->tl_nperqueue[priority]++;
+	threadlist_queue_add(tl, t, priority);
     tl->tl_count++;
 }
 
@@ -189,11 +267,11 @@ threadlist_addtail(struct threadlist *tl, struct thread *t)
 	DEBUGASSERT(tl != NULL);
 	DEBUGASSERT(t != NULL);
     
-    int priority = t->t_priority;
+    int priority = THREAD_PRIORITY(t);
     priority = (priority * tl->tl_nprior) / (PRIORITY_MAX + 1);
 
 	threadlist_insertbeforenode(t, &tl->tl_tail[priority]);
-    tl->tl_nperqueue[priority]++;
+    threadlist_queue_add(tl, t, priority);
 	tl->tl_count++;
 }
 
@@ -201,27 +279,20 @@ struct thread *
 threadlist_remhead(struct threadlist *tl)
 {
 	DEBUGASSERT(tl != NULL);
-	
-	struct threadlistnode *tln = tl->tl_head[0].tln_next;
-
-    DEBUGASSERT(tln != NULL);
     
-    // iterate through all the queues and remove from the
-    // head of the first nonempty queue
-    int i;
-    for(i = 0; i < tl->tl_nprior; i++) {
-        tln = tl->tl_head[i].tln_next;
-        if (tln->tln_next != NULL)
-            break;
-    }
     // all queues are empty
-    if (tln->tln_next == NULL) {
+    if (tl->tl_bitmap == 0) {
         return NULL;
     }
     
+    // remove from the head of the first nonempty queue
+    int i = threadlist_lowbit(tl->tl_bitmap);
+	struct threadlistnode *tln = tl->tl_head[i].tln_next;
+    DEBUGASSERT(tln->tln_next != NULL);
+    
 	threadlist_removenode(tln);
 	DEBUGASSERT(tl->tl_count > 0);
-    tl->tl_nperqueue[i]--;
+    threadlist_queue_rem(tl, i);
 	tl->tl_count--;
 	return tln->tln_self;
 }
@@ -230,27 +301,20 @@ struct thread *
 threadlist_remtail(struct threadlist *tl)
 {
 	DEBUGASSERT(tl != NULL);
-	
-	struct threadlistnode *tln = tl->tl_tail[0].tln_prev;
-
-    DEBUGASSERT(tln != NULL);
     
-    // iterate backwards through all the queues and
-    // and remove the tail of the first nonempty queue
-    int i;
-    for(i = tl->tl_nprior - 1; i >= 0; i--) {
-        tln = tl->tl_tail[i].tln_prev;
-        if (tln->tln_prev != NULL)
-            break;
-    }
     // all queues are empty
-    if (tln->tln_prev == NULL) {
+    if (tl->tl_bitmap == 0) {
         return NULL;
     }
     
+    // remove the tail of the last nonempty queue
+    int i = threadlist_highbit(tl->tl_bitmap);
+	struct threadlistnode *tln = tl->tl_tail[i].tln_prev;
+    DEBUGASSERT(tln->tln_prev != NULL);
+    
 	threadlist_removenode(tln);
 	DEBUGASSERT(tl->tl_count > 0);
-	tl->tl_nperqueue[i]--;
+	threadlist_queue_rem(tl, i);
     tl->tl_count--;
 	return tln->tln_self;
 }
@@ -273,11 +337,50 @@ void threadlist_shuffle(struct threadlist *tl) {
     
 	threadlist_removenode(tln);
     threadlist_insertafternode(&tl->tl_head[0], tln->tln_self);
-	tl->tl_nperqueue[i]--;
-    tl->tl_nperqueue[0]++;
+	threadlist_queue_rem(tl, i);
+    threadlist_queue_add(tl, tln->tln_self, 0);
     return;
 }
 
+/*
+ * Insert in t_vruntime order, behind any threads with the same
+ * vruntime. Only for lists with a single queue (the fair-share run
+ * queue). A thread being added has usually run more recently than
+ * anything already queued, so search from the tail.
+ */
+void
+threadlist_addsorted(struct threadlist *tl, struct thread *t)
+{
+	struct threadlistnode *tln;
+
+	DEBUGASSERT(tl != NULL);
+	DEBUGASSERT(t != NULL);
+	KASSERT(tl->tl_nprior == 1);
+
+	tln = tl->tl_tail[0].tln_prev;
+	while (tln->tln_prev != NULL &&
+	       (int64_t)(tln->tln_self->t_vruntime - t->t_vruntime) > 0) {
+		tln = tln->tln_prev;
+	}
+	threadlist_insertafternode(tln, t);
+	threadlist_queue_add(tl, t, 0);
+	tl->tl_count++;
+}
+
+/*
+ * Return the thread threadlist_remhead would, without removing it.
+ */
+struct thread *
+threadlist_peekhead(struct threadlist *tl)
+{
+	DEBUGASSERT(tl != NULL);
+
+	if (tl->tl_bitmap == 0) {
+		return NULL;
+	}
+	return tl->tl_head[threadlist_lowbit(tl->tl_bitmap)].tln_next->tln_self;
+}
+
 /* Not supported anymore
 void
 threadlist_insertafter(struct threadlist *tl,
@@ -295,11 +398,23 @@ threadlist_insertbefore(struct threadlist *tl,
 	tl->tl_count++;
 }
 
+*/
+
+/*
+ * Take T off TL, wherever it is.
+ */
 void
 threadlist_remove(struct threadlist *tl, struct thread *t)
 {
+	int i;
+
+	DEBUGASSERT(tl != NULL);
+	DEBUGASSERT(t != NULL);
+	KASSERT(t->t_listnode.tln_list == tl);
+
+	i = t->t_listnode.tln_queue;
 	threadlist_removenode(&t->t_listnode);
 	DEBUGASSERT(tl->tl_count > 0);
+	threadlist_queue_rem(tl, i);
 	tl->tl_count--;
 }
-*/
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Per-cpu work queues and worker threads. See workqueue.h.
+ */
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <workqueue.h>
+#include <platform/maxcpus.h>
+
+struct workqueue {
+	struct spinlock wq_lock;		/* protects the queues */
+	struct work *wq_head[WORK_NPRIO];	/* next to run */
+	struct work **wq_tailp[WORK_NPRIO];	/* where to add */
+	struct wchan *wq_wchan;			/* the worker sleeps here */
+};
+
+static struct workqueue workqueues[MAXCPUS];
+
+void
+work_init(struct work *wk, void (*func)(void *), void *arg, unsigned prio)
+{
+	KASSERT(func != NULL);
+	KASSERT(prio < WORK_NPRIO);
+
+	wk->wk_next = NULL;
+	spinlock_data_set(&wk->wk_queued, 0);
+	wk->wk_prio = prio;
+	wk->wk_func = func;
+	wk->wk_arg = arg;
+}
+
+bool
+work_queue_on(struct work *wk, unsigned cpu)
+{
+	struct workqueue *wq;
+
+	KASSERT(cpu < MAXCPUS);
+	wq = &workqueues[cpu];
+	KASSERT(wq->wq_wchan != NULL);
+
+	/* Claim the item; if someone else already has, coalesce. */
+	if (spinlock_data_cas(&wk->wk_queued, 0, 1) != 0) {
+		return false;
+	}
+
+	spinlock_acquire(&wq->wq_lock);
+	wk->wk_next = NULL;
+	*wq->wq_tailp[wk->wk_prio] = wk;
+	wq->wq_tailp[wk->wk_prio] = &wk->wk_next;
+	spinlock_release(&wq->wq_lock);
+
+	wchan_wakeone(wq->wq_wchan);
+	return true;
+}
+
+bool
+work_queue(struct work *wk)
+{
+	/* if we move cpus before it's queued, no matter */
+	return work_queue_on(wk, curcpu->c_number);
+}
+
+bool
+work_pending(struct work *wk)
+{
+	return spinlock_data_get(&wk->wk_queued) != 0;
+}
+
+/*
+ * Take the next item off WQ, highest priority first, or return NULL.
+ * The queue must be locked.
+ */
+static
+struct work *
+workqueue_next(struct workqueue *wq)
+{
+	struct work *wk;
+	unsigned i;
+
+	for (i=0; i<WORK_NPRIO; i++) {
+		wk = wq->wq_head[i];
+		if (wk != NULL) {
+			wq->wq_head[i] = wk->wk_next;
+			if (wq->wq_head[i] == NULL) {
+				wq->wq_tailp[i] = &wq->wq_head[i];
+			}
+			wk->wk_next = NULL;
+			return wk;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Worker thread for cpu number CPU.
+ */
+static
+void
+workqueue_worker(void *unused, unsigned long cpu)
+{
+	struct workqueue *wq = &workqueues[cpu];
+	struct work *wk;
+	void (*func)(void *);
+	void *arg;
+	int result;
+
+	(void)unused;
+
+	/* Get onto our cpu; this moves us there before returning. */
+	result = thread_setaffinity((uint32_t)1 << cpu);
+	KASSERT(result == 0);
+	KASSERT(curcpu->c_number == cpu);
+
+	while (1) {
+		spinlock_acquire(&wq->wq_lock);
+		wk = workqueue_next(wq);
+		if (wk == NULL) {
+			/* hold the channel across the check, as in P() */
+			wchan_lock(wq->wq_wchan);
+			spinlock_release(&wq->wq_lock);
+			wchan_sleep(wq->wq_wchan);
+			continue;
+		}
+		spinlock_release(&wq->wq_lock);
+
+		/* from here on, queueing it again means another run */
+		func = wk->wk_func;
+		arg = wk->wk_arg;
+		spinlock_data_set(&wk->wk_queued, 0);
+
+		func(arg);
+	}
+}
+
+void
+workqueue_bootstrap(void)
+{
+	struct workqueue *wq;
+	unsigned i, j, numcpus;
+	char name[16];
+	int result;
+
+	numcpus = thread_numcpus();
+	KASSERT(numcpus <= MAXCPUS);
+
+	for (i=0; i<numcpus; i++) {
+		wq = &workqueues[i];
+		spinlock_init(&wq->wq_lock);
+		for (j=0; j<WORK_NPRIO; j++) {
+			wq->wq_head[j] = NULL;
+			wq->wq_tailp[j] = &wq->wq_head[j];
+		}
+		wq->wq_wchan = wchan_create("workqueue");
+		if (wq->wq_wchan == NULL) {
+			panic("workqueue_bootstrap: Out of memory\n");
+		}
+
+		snprintf(name, sizeof(name), "worker%u", i);
+		result = thread_fork(name, workqueue_worker, NULL, i, NULL);
+		if (result) {
+			panic("workqueue_bootstrap: thread_fork: %s\n",
+			      strerror(result));
+		}
+	}
+}
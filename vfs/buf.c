@@ -34,6 +34,8 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <clock.h>
+#include <callout.h>
 #include <mainbus.h>
 #include <vfs.h>
 #include <fs.h>
@@ -69,6 +71,7 @@ struct buf {
 	unsigned        b_busy:1;       // currently in use
 	unsigned        b_valid:1;      // contains real data
 	unsigned        b_dirty:1;      // data needs to be written to disk
+	time_t          b_dirtytime;    // when it last became dirty
 	struct thread  *b_holder;       // who did buffer_mark_busy()
 
 	/* key */
@@ -154,7 +157,16 @@ static struct lock *buffer_lock;
  */
 static struct cv *buffer_busy_cv;
 static struct cv *buffer_reserve_cv;
-static struct cv *syncer_cv;
+
+/*
+ * The syncer runs when V'd: by buffer_mark_dirty when too many
+ * buffers are dirty (setting syncer_kicked, under buffer_lock), and
+ * every SYNCER_PERIOD seconds by syncer_callout to write out buffers
+ * that have been dirty for SYNCER_MAXAGE seconds.
+ */
+static struct semaphore *syncer_sem;
+static bool syncer_kicked;
+static struct callout syncer_callout;
 
 /*
  * Magic numbers (also search the code for "voodoo:")
@@ -181,6 +193,12 @@ static struct cv *syncer_cv;
 #define SYNCER_LIMIT_NUM	1
 #define SYNCER_LIMIT_DENOM	2
 
+/* How often (seconds) the syncer looks for old dirty buffers */
+#define SYNCER_PERIOD		1
+
+/* Age (seconds) at which a dirty buffer gets written regardless */
+#define SYNCER_MAXAGE		5
+
 /* Overall limit on fraction of main memory to use for buffers */
 #define BUFFER_MAXMEM_NUM	1
 #define BUFFER_MAXMEM_DENOM	4
@@ -663,6 +681,7 @@ void
 buffer_mark_dirty(struct buf *b)
 {
 	unsigned enough_buffers;
+	uint32_t nsecs;
 
 	KASSERT(b->b_busy);
 	KASSERT(b->b_valid);
@@ -673,6 +692,7 @@ buffer_mark_dirty(struct buf *b)
 	}
 
 	b->b_dirty = 1;
+	gettime(&b->b_dirtytime, &nsecs);
 
 	lock_acquire(buffer_lock);
 	num_dirty_buffers++;
@@ -681,8 +701,9 @@ buffer_mark_dirty(struct buf *b)
 	enough_buffers =
 		(num_total_buffers * SYNCER_DIRTY_NUM) / SYNCER_DIRTY_DENOM;
 
-	if (num_dirty_buffers > enough_buffers) {
-		cv_signal(syncer_cv, buffer_lock);
+	if (num_dirty_buffers > enough_buffers && !syncer_kicked) {
+		syncer_kicked = true;
+		V(syncer_sem);
 	}
 	lock_release(buffer_lock);
 }
@@ -1308,6 +1329,55 @@ sync_some_buffers(void)
 	}
 }
 
+/*
+ * Write out buffers that have been dirty for SYNCER_MAXAGE seconds or
+ * more, so data doesn't sit in memory indefinitely when the cache
+ * isn't under pressure.
+ */
+static
+void
+sync_old_buffers(void)
+{
+	unsigned i;
+	struct buf *b;
+	time_t now;
+	uint32_t nsecs;
+	int result;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+
+	gettime(&now, &nsecs);
+
+	/* Don't cache the array size; it might change as we work. */
+	for (i=0; i<bufarray_num(&attached_buffers); i++) {
+		b = bufarray_get(&attached_buffers, i);
+		if (b == NULL || b->b_busy || b->b_txncount > 0) {
+			continue;
+		}
+		if (b->b_dirty && now - b->b_dirtytime >= SYNCER_MAXAGE) {
+			/* lock may be released (and then re-acquired) here */
+			result = buffer_sync(b);
+			if (result) {
+				kprintf("syncer: warning: %s\n",
+					strerror(result));
+			}
+		}
+	}
+}
+
+/*
+ * Periodic syncer wakeup. Runs in the timer interrupt.
+ */
+static
+void
+syncer_tick(void *x)
+{
+	(void)x;
+
+	V(syncer_sem);
+	callout_schedule(&syncer_callout, SYNCER_PERIOD * HZ);
+}
+
 static
 void
 syncer_thread(void *x1, unsigned long x2)
@@ -1315,12 +1385,16 @@ syncer_thread(void *x1, unsigned long x2)
 	(void)x1;
 	(void)x2;
 
-	lock_acquire(buffer_lock);
 	while (1) {
-		cv_wait(syncer_cv, buffer_lock);
-		sync_some_buffers();
+		P(syncer_sem);
+		lock_acquire(buffer_lock);
+		if (syncer_kicked) {
+			syncer_kicked = false;
+			sync_some_buffers();
+		}
+		sync_old_buffers();
+		lock_release(buffer_lock);
 	}
-	lock_release(buffer_lock);
 }
 
 ////////////////////////////////////////////////////////////
@@ -1429,13 +1503,17 @@ buffer_bootstrap(void)
 		panic("Creating buffer_reserve_cv failed\n");
 	}
 
-	syncer_cv = cv_create("syncer");
-	if (buffer_reserve_cv == NULL) {
-		panic("Creating syncer_cv failed\n");
+	syncer_sem = sem_create("syncer", 0);
+	if (syncer_sem == NULL) {
+		panic("Creating syncer_sem failed\n");
 	}
+	syncer_kicked = false;
 
 	result = thread_fork("syncer", syncer_thread, NULL, 0, NULL);
 	if (result) {
 		panic("Starting syncer failed\n");
 	}
+
+	callout_init(&syncer_callout, syncer_tick, NULL);
+	callout_schedule(&syncer_callout, SYNCER_PERIOD * HZ);
 }
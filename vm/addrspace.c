@@ -37,6 +37,11 @@
 #include <current.h>
 #include <vm.h>
 #include <page_table.h>
+#include <coremem.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <workqueue.h>
+#include <kern/vmstat.h>
 #include "opt-copyonwrite.h"
 #include "opt-asid.h"
 
@@ -46,6 +51,20 @@
  * used. The cheesy hack versions in dumbvm.c are used instead.
  */
 
+/*
+ * Destroying an address space takes time in proportion to its size,
+ * so as_destroy only queues it, and a work item (as_reap) tears it
+ * down AS_REAP_BATCH page table entries at a time, requeueing itself
+ * between batches so other work on its cpu isn't held up for long.
+ * Address spaces on the queue are taken in turn.
+ */
+#define AS_REAP_BATCH 64
+
+static struct spinlock as_reaplock = SPINLOCK_INITIALIZER;
+static struct addrspace *as_reaphead;   // protected by as_reaplock
+static struct addrspace **as_reaptailp; // ...
+static struct work as_reapwork;
+
 struct addrspace *
 as_create(void)
 {
@@ -56,8 +75,15 @@ as_create(void)
 		return NULL;
 	}
     
+    as->as_ptlock = lock_create("as_ptlock");
+    if (as->as_ptlock == NULL) {
+        kfree(as);
+        return NULL;
+    }
+    
     as->as_pgtbl = pt_create();
     if (as->as_pgtbl == NULL) {
+        lock_destroy(as->as_ptlock);
         kfree(as);
         return NULL;
     }
@@ -72,6 +98,11 @@ as_create(void)
 
     as->as_loading = false;
     as->as_id = 0;
+    as->as_rss = 0;
+    as->as_nswap = 0;
+    as->as_swaplist = SWAP_NONE;
+    as->as_rss_limit = 0;
+    as->as_dying = false;
 	return as;
 }
  
@@ -82,13 +113,32 @@ as_copy(struct addrspace *old_as, struct addrspace **ret)
 	if (new_as == NULL) {
 		return ENOMEM;
 	}
+    
+    // the child inherits the resident limit, and is charged only
+    // for frames it copies
+    new_as->as_rss = 0;
+    new_as->as_nswap = 0;
+    new_as->as_swaplist = SWAP_NONE;
+    new_as->as_rss_limit = old_as->as_rss_limit;
+    new_as->as_dying = false;
+    
+    new_as->as_ptlock = lock_create("as_ptlock");
+    if (new_as->as_ptlock == NULL) {
+        kfree(new_as);
+        return ENOMEM;
+    }
 
+    // other threads of the parent may be faulting in pages as we go
+    lock_acquire(old_as->as_ptlock);
 #if OPT_COPYONWRITE
-	new_as->as_pgtbl = pt_copy_shallow(old_as->as_pgtbl);
+	new_as->as_pgtbl = pt_copy_shallow(old_as->as_pgtbl, new_as);
 #else
-    new_as->as_pgtbl = pt_copy_deep(old_as->as_pgtbl);
+    new_as->as_pgtbl = pt_copy_deep(old_as->as_pgtbl, new_as);
 #endif
+    lock_release(old_as->as_ptlock);
     if (new_as->as_pgtbl == NULL) {
+        core_disown(new_as);
+        lock_destroy(new_as->as_ptlock);
         kfree(new_as);
         return ENOMEM;
     }
@@ -103,14 +153,73 @@ as_copy(struct addrspace *old_as, struct addrspace **ret)
     return 0;
 }
 
+static
 void
-as_destroy(struct addrspace *as)
+as_reap(void *unused)
 {
-	pt_destroy(as->as_pgtbl);
+    (void)unused;
+    
+    // take the first in line, so a concurrent run takes another
+    spinlock_acquire(&as_reaplock);
+    struct addrspace *as = as_reaphead;
+    if (as != NULL) {
+        as_reaphead = as->as_reapnext;
+        if (as_reaphead == NULL)
+            as_reaptailp = &as_reaphead;
+    }
+    spinlock_release(&as_reaplock);
+    if (as == NULL)
+        return;
+    
+    if (pt_destroy_some(as->as_pgtbl, &as->as_reappos, AS_REAP_BATCH, as)) {
+        // drop charges held by frames still shared with others
+        core_disown(as);
 #if OPT_ASID
-    tlb_flush_asid(as->as_id);
+        tlb_flush_asid(as->as_id);
 #endif
-	kfree(as);
+        lock_destroy(as->as_ptlock);
+        kfree(as);
+    }
+    else {
+        // back of the line
+        spinlock_acquire(&as_reaplock);
+        as->as_reapnext = NULL;
+        *as_reaptailp = as;
+        as_reaptailp = &as->as_reapnext;
+        spinlock_release(&as_reaplock);
+    }
+    
+    if (as_reaphead != NULL)
+        work_queue(&as_reapwork);
+}
+
+void
+as_reaper_bootstrap(void)
+{
+    as_reaphead = NULL;
+    as_reaptailp = &as_reaphead;
+    work_init(&as_reapwork, as_reap, NULL, WORK_LOW);
+}
+
+/*
+ * Queue the address space for as_reap to destroy, and return at once.
+ * Nothing may use it after this. Until as_reap gets to them, its
+ * pages stay mapped and charged; marking it dying lets eviction take
+ * them without writing them to swap first.
+ */
+void
+as_destroy(struct addrspace *as)
+{
+    as->as_dying = true;
+    as->as_reappos = 0;
+    as->as_reapnext = NULL;
+    
+    spinlock_acquire(&as_reaplock);
+    *as_reaptailp = as;
+    as_reaptailp = &as->as_reapnext;
+    spinlock_release(&as_reaplock);
+    
+    work_queue(&as_reapwork);
 }
 
 void
@@ -196,6 +305,32 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+int
+as_define_threadstack(struct addrspace *as, int n, vaddr_t *stackptr)
+{
+    vaddr_t stacktop = USERSTACK - (vaddr_t)n * STACK_NPAGES * PAGE_SIZE;
+    vaddr_t stackbase = stacktop - STACK_NPAGES * PAGE_SIZE;
+    
+    KASSERT(n >= 0);
+    
+    if (stackbase < as->AS_STACK.seg_base) {
+        // check for overlap with the heap
+        vaddr_t heaptop = as->AS_HEAP.seg_base + as->AS_HEAP.seg_size;
+        if (stackbase < heaptop)
+            return ENOMEM;
+        
+        // The process's other threads may be faulting on the stack
+        // meanwhile, so grow the size before moving the base down.
+        // In between, the segment runs on past USERSTACK into kernel
+        // space, which user faults never reach.
+        *(volatile size_t *)&as->AS_STACK.seg_size = USERSTACK - stackbase;
+        *(volatile vaddr_t *)&as->AS_STACK.seg_base = stackbase;
+    }
+    
+    *stackptr = stacktop;
+    return 0;
+}
+
 bool
 as_can_read(struct addrspace *as, vaddr_t vaddr)
 {
@@ -252,6 +387,15 @@ as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *old_heaptop)
     return 0;
 }
 
+void
+as_memstat(struct addrspace *as, struct memstat *ms)
+{
+    // unlocked reads: each counter is a single word
+    ms->ms_rss = as->as_rss;
+    ms->ms_swap = as->as_nswap;
+    ms->ms_rss_limit = as->as_rss_limit;
+}
+
 bool
 seg_available(const struct segment *seg)
 {
@@ -31,8 +31,12 @@
 #include <machine/vm.h>
 #include <machine/tlb.h>
 #include <lib.h>
+#include <cpu.h>
 #include <thread.h>
+#include <current.h>
 #include <wchan.h>
+#include <clock.h>
+#include <callout.h>
 #include <swap.h>
 #include <addrspace.h>
 #include <vmstat.h>
@@ -45,6 +49,9 @@
 #define MAX_DIRTY (core_len/2)
 // Number of dirty pages at which the cleaner thread sleeps
 #define MIN_DIRTY (core_len/8)
+// Hardclocks between the cleaner's aging passes, which clean pages
+// that have stayed dirty since the previous one
+#define CLEAN_PERIOD (2 * HZ)
 
 // Macro to go from coremap entry to physical address
 #define CORE_TO_PADDR(i) (core_frame0 + i * PAGE_SIZE)
@@ -62,14 +69,22 @@ struct cm_entry {
     unsigned         cme_kernel:1;   // In use by kernel?
     unsigned         cme_busy:1;     // For synchronization
     unsigned         cme_to_free:1;  // Defer freeing a busy block
+    unsigned         cme_aging:1;    // Dirty at last aging pass?
+    unsigned         cme_wanted:1;   // Skipped by a sweep while busy?
     unsigned         cme_swapblk:24; // Swap backing block
     vaddr_t          cme_vaddr;      // Resident virtual address
     struct pt_entry *cme_resident;   // Resident virtual page mapping
+    struct addrspace *cme_owner;     // Address space charged for the frame
 };
 
 static struct cm_entry *coremap;
-static struct spinlock  core_lock = SPINLOCK_INITIALIZER;
+static struct spinlock  core_lock = SPINLOCK_TICKET_INITIALIZER;
 static struct wchan    *core_cleaner_wchan;
+static struct callout   core_cleaner_callout;
+static volatile bool    core_aging;          // aging pass requested
+static struct wchan    *core_reclaim_wchan;  // threads waiting for a frame
+static volatile unsigned core_reclaim_gen;   // bumped when frames may free up
+static unsigned         core_nwaiting;       // # of threads on core_reclaim_wchan
 static size_t           core_lruclock;
 static size_t           core_len;
 paddr_t                 core_frame0; // physical address of first managed frame
@@ -111,24 +126,37 @@ cme_do_free(struct cm_entry *cme)
         vs_decr_ram_wired();
     vs_incr_ram_free();
     
+    // a frame is now free: let throttled threads retry
+    core_reclaim_gen++;
+    
+    // uncharge the owner
+    if (cme->cme_owner != NULL)
+        cme->cme_owner->as_rss--;
+    
     // clear the CME
     cme->cme_kernel = 0;
     cme->cme_to_free = 0;
+    cme->cme_aging = 0;
     cme->cme_swapblk = 0;
     cme->cme_vaddr = 0;
     cme->cme_resident = NULL;
+    cme->cme_owner = NULL;
 }
 
-// helper function for cleaner daemon only
+// helper function for cleaner daemon and eviction
 // not exported in coremem.h
+// If WANT is set and the CME is busy, it is marked so that
+// cme_unlock() tells threads waiting for a frame to look again.
 static
 bool
-cme_try_lock(size_t index)
+cme_try_lock(size_t index, bool want)
 {
     struct cm_entry *cme = &coremap[index];
     
     spinlock_acquire(&core_lock);
     if (cme->cme_busy) {
+        if (want)
+            cme->cme_wanted = 1;
         spinlock_release(&core_lock);
         return false;
     }
@@ -148,11 +176,25 @@ cme_unlock(size_t index)
     spinlock_acquire(&core_lock);
     
     // if the deferred free bit is set, free the frame now
-    if (coremap[index].cme_to_free)
+    bool wake = false;
+    if (coremap[index].cme_to_free) {
         cme_do_free(&coremap[index]);
+        wake = (core_nwaiting > 0);
+    }
+    
+    // a sweep passed this frame over because we held it; it
+    // may be reclaimable now, so the sweep must not sleep
+    if (coremap[index].cme_wanted) {
+        coremap[index].cme_wanted = 0;
+        core_reclaim_gen++;
+        wake = (core_nwaiting > 0);
+    }
     
     coremap[index].cme_busy = 0;
     spinlock_release(&core_lock);
+    
+    if (wake)
+        wchan_wakeall(core_reclaim_wchan);
 }
 
 // tries to clean a single frame...
@@ -187,6 +229,102 @@ cme_try_clean(size_t index)
     return false;
 }
 
+// Look up the frame's owner once, under core_lock: *OVER is set if
+// it is over its resident limit, and *DYING if it has been destroyed
+// and is waiting for as_reap.  Eviction takes such frames even if
+// they are active or dirty, and a dying owner's pages will never be
+// read again, so they need not be written to swap.
+static
+void
+cme_owner_state(size_t index, bool *over, bool *dying)
+{
+    spinlock_acquire(&core_lock);
+    struct addrspace *as = coremap[index].cme_owner;
+    *over = (as != NULL && as->as_rss_limit != 0
+             && as->as_rss > as->as_rss_limit);
+    *dying = (as != NULL && as->as_dying);
+    spinlock_release(&core_lock);
+}
+
+/**************** RECLAIM THROTTLING ****************/
+
+// Record that some frame may have become reclaimable (it was
+// cleaned, or its active bit was cleared).  If WAKE is set,
+// threads sleeping in core_reclaim_wait() are woken to retry.
+static
+void
+core_reclaim_progress(bool wake)
+{
+    spinlock_acquire(&core_lock);
+    core_reclaim_gen++;
+    wake = wake && (core_nwaiting > 0);
+    spinlock_release(&core_lock);
+    
+    if (wake)
+        wchan_wakeall(core_reclaim_wchan);
+}
+
+// Whether the current thread may block for a frame.  Kernel faults
+// can happen in interrupt handlers or with spinlocks held, and the
+// wait channel does not exist until the cleaner is started; in
+// those cases we keep spinning as before.
+static
+bool
+core_reclaim_can_sleep(void)
+{
+    return core_reclaim_wchan != NULL
+        && CURCPU_EXISTS()
+        && !curthread->t_in_interrupt
+        && curthread->t_curspl == 0;
+}
+
+// Called by the core_acquire functions after a full sweep of the
+// coremap turns up no frame.  If nothing has happened since *gen
+// was sampled that might make a frame available, sleep until the
+// cleaner, a free, or the unlock of a frame the sweep skipped makes
+// progress rather than spinning.  Either way, *gen is resampled for
+// the next sweep.
+//
+// Frames skipped only because their PTE was locked give no signal
+// when it is unlocked, so if *SKIPPED is set we just yield and sweep
+// again; PTEs are not held for long.  *SKIPPED is cleared.
+static
+void
+core_reclaim_wait(unsigned *gen, bool *skipped)
+{
+    if (*skipped && core_reclaim_can_sleep()) {
+        *skipped = false;
+        thread_yield();
+    }
+    else if (core_reclaim_can_sleep()) {
+        // let the cleaner turn dirty frames into clean ones
+        wchan_wakeone(core_cleaner_wchan);
+        
+        // the wchan lock is held from the check until we are on
+        // the channel, and core_reclaim_progress() bumps the
+        // generation before waking, so no wakeup can be lost
+        wchan_lock(core_reclaim_wchan);
+        spinlock_acquire(&core_lock);
+        if (core_reclaim_gen == *gen) {
+            core_nwaiting++;
+            spinlock_release(&core_lock);
+            
+            vs_incr_reclaim_waits();
+            wchan_sleep(core_reclaim_wchan);
+            
+            spinlock_acquire(&core_lock);
+            core_nwaiting--;
+            spinlock_release(&core_lock);
+        }
+        else {
+            spinlock_release(&core_lock);
+            wchan_unlock(core_reclaim_wchan);
+        }
+    }
+    
+    *gen = core_reclaim_gen;
+}
+
 /**************************************************/
 
 void
@@ -197,6 +335,8 @@ core_bootstrap(void)
     paddr_t hi;
     ram_getsize(&lo, &hi);
     
+    spinlock_setname(&core_lock, "core_lock");
+    
     // page align lo to the next free page
     KASSERT(lo == (lo & PAGE_FRAME));
     core_frame0 = lo;
@@ -232,10 +372,11 @@ core_bootstrap(void)
 // This gets called from each of the core_acquire functions.
 // It checks a frame for suitability.  The CME must be
 // locked before core_clockhand is called, and is locked
-// upon return
+// upon return.  *skipped is set if the frame was passed
+// over only because its PTE was locked.
 static
 bool
-core_clockhand(size_t index, int on_active)
+core_clockhand(size_t index, int on_active, bool *skipped)
 {
     // ignore kernel-reserved pages
     if (coremap[index].cme_kernel)
@@ -257,10 +398,25 @@ core_clockhand(size_t index, int on_active)
         // physical page
         KASSERT(pte_resident(pte));
         
-        if (pte_is_dirty(pte)) {
+        // prefer frames of address spaces over their resident limit,
+        // and those of dead ones most of all.  The owner is read with
+        // the PTE locked: an address space that stops mapping a
+        // shared frame gives up its charge under the same lock (see
+        // core_unshare), so a dying owner here still maps the page.
+        bool over, dying;
+        cme_owner_state(index, &over, &dying);
+        bool offender = over || dying;
+        if (offender)
+            on_active = ACTIVE_IGNORE;
+        
+        // a dead address space's own pages can just be dropped;
+        // those shared copy-on-write are still someone else's
+        bool discard = dying && !pte_is_shared(pte);
+        
+        if (pte_is_dirty(pte) && !discard) {
             // skip dirty pages if there are relatively few of them
-            // else try to clean them
-            if (vs_get_ram_dirty() < MAX_DIRTY) {
+            // (unless they belong to an offender), else try to clean them
+            if (!offender && vs_approx_ram_dirty() < MAX_DIRTY) {
                 pte_unlock(pte);
                 return false;
             }
@@ -280,6 +436,10 @@ core_clockhand(size_t index, int on_active)
                     break;
                 case ACTIVE_REFRESH: // refresh the PTE/TLB and move on
                     pte_refresh(vaddr, pte);
+                    pte_unlock(pte);
+                    // the next sweep may take this frame
+                    core_reclaim_progress(false);
+                    return false;
                 case ACTIVE_SKIP: // just move on
                     pte_unlock(pte);
                     return false;
@@ -288,7 +448,27 @@ core_clockhand(size_t index, int on_active)
         
         // found a frame that has not been recently accessed
         // re-map the PTE to its swap block
-        pte_evict(pte, coremap[index].cme_swapblk);
+        swapidx_t swapblk = coremap[index].cme_swapblk;
+        if (discard)
+            pte_discard(pte, swapblk);
+        else
+            pte_evict(pte, swapblk);
+        
+        // move the owner's charge from RAM to swap, noting whose
+        // it is for swap-in; the PTE is still locked, so the page
+        // cannot come back before that is recorded
+        // (a discarded page is just uncharged)
+        spinlock_acquire(&core_lock);
+        struct addrspace *owner = coremap[index].cme_owner;
+        if (owner != NULL) {
+            owner->as_rss--;
+            if (!discard) {
+                owner->as_nswap++;
+                swap_set_owner(swapblk, owner);
+            }
+        }
+        coremap[index].cme_owner = NULL;
+        spinlock_release(&core_lock);
         pte_unlock(pte);
         
         // mark the CME as free and update stats
@@ -302,6 +482,7 @@ core_clockhand(size_t index, int on_active)
         
         return true;
     }
+    *skipped = true;
     return false;
 }
 
@@ -313,16 +494,26 @@ static
 paddr_t
 core_acquire_oneclock(void)
 {
+    unsigned gen = core_reclaim_gen;
+    size_t swept = 0;
+    bool skipped = false;
+    
     while(true) {
         // get current clock hand and increment clock
         size_t index = core_clocktick();
         
         // try to lock the coremap entry
-        if (cme_try_lock(index)) {
-            if (core_clockhand(index, ACTIVE_REFRESH))
+        if (cme_try_lock(index, true)) {
+            if (core_clockhand(index, ACTIVE_REFRESH, &skipped))
                 return CORE_TO_PADDR(index);
             cme_unlock(index);
         }
+        
+        // throttle after a full sweep with no frame
+        if (++swept == core_len) {
+            core_reclaim_wait(&gen, &skipped);
+            swept = 0;
+        }
     }
 }
 
@@ -335,6 +526,10 @@ static
 paddr_t
 core_acquire_twoclock(void)
 {
+    unsigned gen = core_reclaim_gen;
+    size_t swept = 0;
+    bool skipped = false;
+    
     while(true) {
         // get trailing (page-grabbing) clock hand and increment clock
         size_t trailing = core_clocktick();
@@ -342,25 +537,35 @@ core_acquire_twoclock(void)
         // calculate the leading clock hand
         size_t leading = (trailing + CLOCK_OFFSET) % core_len;
         // mark the PTE the second clock hand is pointing at as not recently used
-        if (cme_try_lock(leading)) {
+        if (cme_try_lock(leading, false)) {
             if (!coremap[leading].cme_kernel) {
                 struct pt_entry *pte = coremap[leading].cme_resident;
                 vaddr_t vaddr = coremap[leading].cme_vaddr;
                 
                 if (pte && pte_try_lock(pte)) {
+                    bool was_active = pte_is_active(pte);
                     pte_refresh(vaddr, pte);
                     pte_unlock(pte);
+                    // the trailing hand may take this frame
+                    if (was_active)
+                        core_reclaim_progress(false);
                 }
             }
             cme_unlock(leading);
         }                    
     
         // run the trailing hand
-        if (cme_try_lock(trailing)) {
-            if (core_clockhand(trailing, ACTIVE_SKIP))
+        if (cme_try_lock(trailing, true)) {
+            if (core_clockhand(trailing, ACTIVE_SKIP, &skipped))
                 return CORE_TO_PADDR(trailing);
             cme_unlock(trailing);
         }
+        
+        // throttle after a full sweep with no frame
+        if (++swept == core_len) {
+            core_reclaim_wait(&gen, &skipped);
+            swept = 0;
+        }
     }
 }
 
@@ -375,29 +580,35 @@ core_acquire_random(void)
     // start at an index uniformly distributed over the core map
     // otherwise start at 0
     int index = is_random_init()? (random() % core_len) : 0;
+    unsigned gen = core_reclaim_gen;
+    size_t swept = 0;
+    bool skipped = false;
         
     while(true) {
         // try to lock the coremap entry
-        if (cme_try_lock(index)) {
-            if (core_clockhand(index, ACTIVE_IGNORE))
+        if (cme_try_lock(index, true)) {
+            if (core_clockhand(index, ACTIVE_IGNORE, &skipped))
                 return CORE_TO_PADDR(index);
             cme_unlock(index);
         }
         
         // move on
         index = (index + 1) % core_len;
+        
+        // throttle after a full sweep with no frame
+        if (++swept == core_len) {
+            core_reclaim_wait(&gen, &skipped);
+            swept = 0;
+        }
     }
 }
 #endif
 
+// run the configured eviction policy for a single frame
+static
 paddr_t
-core_acquire_frame(void)
+core_acquire_policy(void)
 {
-    // wake up the cleaner thread if necessary
-    if (vs_get_ram_dirty() >= MAX_DIRTY) {
-        wchan_wakeone(core_cleaner_wchan);
-    }
-    
 #if OPT_ONECLOCK
     return core_acquire_oneclock();
 #elif OPT_TWOCLOCK
@@ -407,6 +618,36 @@ core_acquire_frame(void)
 #endif
 }
 
+paddr_t
+core_acquire_frame(void)
+{
+    // wake up the cleaner thread if necessary
+    if (vs_approx_ram_dirty() >= MAX_DIRTY) {
+        wchan_wakeone(core_cleaner_wchan);
+    }
+    
+    return core_acquire_policy();
+}
+
+// Acquire a batch of frames with a single cleaner check.
+// On return, each acquired CME is locked.
+unsigned
+core_acquire_frames(paddr_t *frames, unsigned nframes)
+{
+    // wake up the cleaner thread once for the whole batch
+    if (vs_approx_ram_dirty() >= MAX_DIRTY) {
+        wchan_wakeone(core_cleaner_wchan);
+    }
+    
+    unsigned i;
+    for (i = 0; i < nframes; i++) {
+        frames[i] = core_acquire_policy();
+        if (frames[i] == 0)
+            break;
+    }
+    return i;
+}
+
 void
 core_release_frame(paddr_t frame)
 {
@@ -414,7 +655,8 @@ core_release_frame(paddr_t frame)
 }
 
 void
-core_map_frame(paddr_t frame, vaddr_t vaddr, struct pt_entry *pte, swapidx_t swapblk)
+core_map_frame(paddr_t frame, vaddr_t vaddr, struct pt_entry *pte,
+               swapidx_t swapblk, struct addrspace *owner)
 {
     // get the CME
     struct cm_entry *cme = &coremap[PADDR_TO_CORE(frame)];
@@ -423,10 +665,19 @@ core_map_frame(paddr_t frame, vaddr_t vaddr, struct pt_entry *pte, swapidx_t swa
     KASSERT(cme->cme_busy);
     
     cme->cme_kernel = 0;
+    cme->cme_aging = 0;
     cme->cme_swapblk = swapblk;
     cme->cme_vaddr = vaddr;
     cme->cme_resident = pte;
     
+    // charge the owner
+    spinlock_acquire(&core_lock);
+    KASSERT(cme->cme_owner == NULL);
+    cme->cme_owner = owner;
+    if (owner != NULL)
+        owner->as_rss++;
+    spinlock_release(&core_lock);
+    
     // update stats
     vs_decr_ram_free();
     vs_incr_ram_inactive();
@@ -445,6 +696,7 @@ core_reserve_frame(paddr_t frame)
     cme->cme_swapblk = 0;
     cme->cme_vaddr = 0;
     cme->cme_resident = NULL;
+    cme->cme_owner = NULL;
     
     // update stats
     vs_decr_ram_free();
@@ -467,8 +719,59 @@ core_free_frame(paddr_t frame)
     
     // Otherwise, just free the frame
     cme_do_free(cme);
+    bool wake = (core_nwaiting > 0);
     
     spinlock_release(&core_lock);
+    
+    if (wake)
+        wchan_wakeall(core_reclaim_wchan);
+}
+
+void
+core_uncharge_swap(swapidx_t swapblk)
+{
+    spinlock_acquire(&core_lock);
+    // pages shared copy-on-write are charged to whichever address
+    // space brought them in, not necessarily the one faulting now
+    struct addrspace *as = swap_clear_owner(swapblk);
+    if (as != NULL) {
+        KASSERT(as->as_nswap > 0);
+        as->as_nswap--;
+    }
+    spinlock_release(&core_lock);
+}
+
+void
+core_unshare(paddr_t frame, struct addrspace *as)
+{
+    struct cm_entry *cme = &coremap[PADDR_TO_CORE(frame)];
+    
+    spinlock_acquire(&core_lock);
+    if (as != NULL && cme->cme_owner == as) {
+        cme->cme_owner = NULL;
+        as->as_rss--;
+    }
+    spinlock_release(&core_lock);
+}
+
+void
+core_disown(struct addrspace *as)
+{
+    spinlock_acquire(&core_lock);
+    // once the page table is gone, the only frames still charged
+    // here are those shared with other address spaces
+    for (size_t i = 0; i < core_len && as->as_rss > 0; i++) {
+        if (coremap[i].cme_owner == as) {
+            coremap[i].cme_owner = NULL;
+            as->as_rss--;
+        }
+    }
+    // and by pages in swap
+    if (as->as_nswap > 0) {
+        swap_disown(as);
+        as->as_nswap = 0;
+    }
+    spinlock_release(&core_lock);
 }
 
 // Does not wait on PTE
@@ -481,26 +784,52 @@ core_clean(void *data1, unsigned long data2)
     (void)data2;
     
     size_t index = 0;
+    size_t cleaned = 0; // # of pages cleaned in this pass
+    size_t aging_left = 0; // # of CMEs left in the current aging pass
     while (true)
     {
         struct cm_entry *cme = &coremap[index];
+        
+        // under pressure, clean every dirty page; otherwise, on an
+        // aging pass, only those that were dirty on the last one
+        bool pressure = (vs_approx_ram_dirty() > MIN_DIRTY
+                         || core_nwaiting > 0);
+        if (core_aging) {
+            core_aging = false;
+            aging_left = core_len;
+        }
+        
         // check the CME first to reduce contention and increase throughput
         if(!(cme->cme_busy) && !(cme->cme_kernel) && cme->cme_resident) {
             // try to lock both the CME and PTE
             // if it fails, go to the next cme
-            if (cme_try_lock(index)) {
+            if (cme_try_lock(index, false)) {
                 if (!(cme->cme_kernel)  // check conditions again to ensure nothing
                 && cme->cme_resident    // changed while we were getting the lock
                 && pte_try_lock(cme->cme_resident)) {
-                    // if dirty, then start cleaning
-                    if(pte_is_dirty(cme->cme_resident)) {
-                        if (cme_try_clean(index))
+                    // if dirty (and old enough), then start cleaning
+                    if(pte_is_dirty(cme->cme_resident)
+                    && !pressure && !cme->cme_aging) {
+                        // young; clean it next pass if still dirty
+                        if (aging_left > 0)
+                            cme->cme_aging = 1;
+                        pte_unlock(cme->cme_resident);
+                    }
+                    else if(pte_is_dirty(cme->cme_resident)) {
+                        if (cme_try_clean(index)) {
                             pte_unlock(cme->cme_resident);
+                            cme->cme_aging = 0;
+                            cleaned++;
+                            // a clean frame can be evicted
+                            core_reclaim_progress(true);
+                        }
                         // If the cleaning failed, the PTE is already
                         // unlocked.
                     }
-                    else
+                    else {
+                        cme->cme_aging = 0;
                         pte_unlock(cme->cme_resident);
+                    }
                 }
                 cme_unlock(index);
             }
@@ -508,19 +837,51 @@ core_clean(void *data1, unsigned long data2)
         
         // move on
         index = (index + 1) % core_len;
-
-        // go to sleep if cleaning is unneeded
-        if (vs_get_ram_dirty() <= MIN_DIRTY) {
+        if (aging_left > 0)
+            aging_left--;
+        
+        // go to sleep if cleaning is unneeded, i.e., there are few
+        // dirty pages, nobody is waiting for a frame and no aging
+        // pass is under way, or a whole pass over the coremap under
+        // pressure cleaned nothing
+        bool idle = (vs_approx_ram_dirty() <= MIN_DIRTY
+                     && core_nwaiting == 0 && aging_left == 0);
+        // (but while threads wait for a frame, keep going, only
+        // letting others run between passes)
+        if (index == 0) {
+            if (cleaned == 0 && core_nwaiting > 0)
+                thread_yield();
+            else
+                idle = idle || (cleaned == 0 && aging_left == 0);
+            cleaned = 0;
+        }
+        if (idle) {
             wchan_lock(core_cleaner_wchan);
             wchan_sleep(core_cleaner_wchan);
         }
     }
 }
 
+// Start an aging pass every CLEAN_PERIOD. Runs in the timer interrupt.
+static
+void
+core_cleaner_tick(void *unused)
+{
+    (void)unused;
+    
+    core_aging = true;
+    wchan_wakeone(core_cleaner_wchan);
+    callout_schedule(&core_cleaner_callout, CLEAN_PERIOD);
+}
+
 void core_cleaner_bootstrap(void)
 {
     core_cleaner_wchan = wchan_create("Core Cleaner Wait Channel");
+    core_reclaim_wchan = wchan_create("Core Reclaim Wait Channel");
     thread_fork("Core Cleaner", core_clean, NULL, 0, NULL);
+    
+    callout_init(&core_cleaner_callout, core_cleaner_tick, NULL);
+    callout_schedule(&core_cleaner_callout, CLEAN_PERIOD);
 }
 
 
@@ -598,8 +598,9 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+static
 void *
-kmalloc(size_t sz)
+kmalloc_flags(size_t sz, int flags)
 {
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
@@ -607,7 +608,7 @@ kmalloc(size_t sz)
 
 		/* Round up to a whole number of pages. */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
+		address = alloc_kpages_flags(npages, flags);
 		if (address==0) {
 			return NULL;
 		}
@@ -618,6 +619,18 @@ kmalloc(size_t sz)
 	return subpage_kmalloc(sz);
 }
 
+void *
+kmalloc(size_t sz)
+{
+	return kmalloc_flags(sz, 0);
+}
+
+void *
+kmalloc_eager(size_t sz)
+{
+	return kmalloc_flags(sz, KALLOC_EAGER);
+}
+
 void
 kfree(void *ptr)
 {
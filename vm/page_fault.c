@@ -31,17 +31,26 @@
 #include <machine/tlb.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <page_table.h>
+#include <addrspace.h>
 #include <coremem.h>
 #include <swap.h>
 #include <vmstat.h>
 #include <vm.h>
 
 // Handle a page fault in the case in which the virtual
-// page is unmapped.  The PTE is already locked.
+// page is unmapped.
+//
+// Other threads of the process may be faulting on the same page,
+// or on others under the same level 2 table, so the entry is only
+// created under as_ptlock, after checking again that there isn't
+// one. The frame and swap block are got first, so as not to hold
+// the lock while waiting for memory.
 int
-vm_unmapped_page_fault(vaddr_t faultaddress, struct page_table *pt)
+vm_unmapped_page_fault(vaddr_t faultaddress, struct addrspace *as)
 {
+    struct page_table *pt = as->as_pgtbl;
     int err;
     
     // find a free page frame
@@ -49,27 +58,40 @@ vm_unmapped_page_fault(vaddr_t faultaddress, struct page_table *pt)
     if (frame == 0)
         return ENOMEM;
     
-    // create a page table entry
-    struct pt_entry *pte = pt_create_entry(pt, faultaddress, frame);
-    if (pte == NULL) {
-        core_release_frame(frame);
-        return ENOMEM;
-    }
-    
     // get a swap block
     swapidx_t swapblk;
     err = swap_get_free(&swapblk);
     if (err) {
-        pt_destroy_entry(pt, faultaddress);
         core_release_frame(frame);
         return err;
     }
     
+    lock_acquire(as->as_ptlock);
+    struct pt_entry *pte = pt_acquire_entry(pt, faultaddress);
+    if (pte != NULL) {
+        // another thread mapped the page first; retry the access,
+        // which takes the ordinary path now
+        lock_release(as->as_ptlock);
+        pte_unlock(pte);
+        swap_free(swapblk);
+        core_release_frame(frame);
+        return 0;
+    }
+    
+    // create a page table entry
+    pte = pt_create_entry(pt, faultaddress, frame);
+    lock_release(as->as_ptlock);
+    if (pte == NULL) {
+        swap_free(swapblk);
+        core_release_frame(frame);
+        return ENOMEM;
+    }
+    
     // zero the frame
     bzero((void *)PADDR_TO_KVADDR(frame), PAGE_SIZE);
     
     // update the core map
-    core_map_frame(frame, faultaddress & PAGE_FRAME, pte, swapblk);
+    core_map_frame(frame, faultaddress & PAGE_FRAME, pte, swapblk, as);
     core_release_frame(frame);
     
     
@@ -85,7 +107,8 @@ vm_unmapped_page_fault(vaddr_t faultaddress, struct page_table *pt)
 // Handle a page fault in the case in which the page has
 // been swapped out.  The PTE is already locked.
 int
-vm_swapin_page_fault(vaddr_t faultaddress, struct pt_entry *pte)
+vm_swapin_page_fault(vaddr_t faultaddress, struct pt_entry *pte,
+                     struct addrspace *as)
 {
     // find a free page frame
     paddr_t frame = core_acquire_frame();
@@ -105,9 +128,10 @@ vm_swapin_page_fault(vaddr_t faultaddress, struct pt_entry *pte)
         return err;
     }
     
-    // update the core map
-    core_map_frame(frame, faultaddress & PAGE_FRAME, pte, swapblk);
+    // update the core map and move the page's charge out of swap
+    core_map_frame(frame, faultaddress & PAGE_FRAME, pte, swapblk, as);
     core_release_frame(frame);
+    core_uncharge_swap(swapblk);
     
     // clean up
     pte_finish_swapin(pte);
@@ -122,9 +146,9 @@ vm_swapin_page_fault(vaddr_t faultaddress, struct pt_entry *pte)
 
 // Handle a copy-on-write fault.  The old PTE is already locked.
 int
-vm_copyonwrite_fault(vaddr_t faultaddress, struct page_table *pt)
+vm_copyonwrite_fault(vaddr_t faultaddress, struct addrspace *as)
 {
-    struct pt_entry *new_pte = pt_copyonwrite(pt, faultaddress);
+    struct pt_entry *new_pte = pt_copyonwrite(as->as_pgtbl, faultaddress, as);
     // Old pte is now unlocked
     
     if (new_pte == NULL) {
@@ -37,10 +37,21 @@
 #include <vfs.h>
 #include <stat.h>
 #include <vmstat.h>
+#include <addrspace.h>
 #include <swap.h>
 
 static struct vnode     *swap_vnode;
 static struct bitmap    *swap_map;
+static unsigned          swap_nblocks;
+
+// The address space charged for each swapped block, and its place on
+// that address space's list (as_swaplist) of them
+struct swap_owner {
+    struct addrspace    *so_as;
+    swapidx_t            so_prev;
+    swapidx_t            so_next;
+};
+static struct swap_owner *swap_owners;  // protected by swap_lock
 static struct spinlock   swap_lock;
 static struct wchan     *swap_wchan;
 
@@ -62,18 +73,25 @@ swap_bootstrap(void)
     if (err)
         panic("swap_bootstrap: %s\n", strerror(err));
     
-    swap_map = bitmap_create(swap_stat.st_size / PAGE_SIZE);
+    swap_nblocks = swap_stat.st_size / PAGE_SIZE;
+    swap_map = bitmap_create(swap_nblocks);
     if (swap_map == NULL)
         panic("swap_bootstrap: Out of memory.\n");
     
+    swap_owners = kmalloc(swap_nblocks * sizeof(struct swap_owner));
+    if (swap_owners == NULL)
+        panic("swap_bootstrap: Out of memory.\n");
+    bzero(swap_owners, swap_nblocks * sizeof(struct swap_owner));
+    
     swap_wchan = wchan_create("Swap Wait Channel");
     if (swap_wchan == NULL)
         panic("swap_bootstrap: Out of memory.\n");
     
-    spinlock_init(&swap_lock);
+    spinlock_init_ticket(&swap_lock);
+    spinlock_setname(&swap_lock, "swap_lock");
     
     // set up statistics
-    vs_init_swap(swap_stat.st_size / PAGE_SIZE);
+    vs_init_swap(swap_nblocks);
 }
 
 int
@@ -159,6 +177,62 @@ swap_out(paddr_t src, swapidx_t dst)
     return VOP_WRITE(swap_vnode, &swapout_uio);
 }
 
+void
+swap_set_owner(swapidx_t blk, struct addrspace *as)
+{
+    KASSERT(blk < swap_nblocks);
+    
+    spinlock_acquire(&swap_lock);
+    struct swap_owner *so = &swap_owners[blk];
+    KASSERT(so->so_as == NULL);
+    
+    // put it at the head of AS's list
+    so->so_as = as;
+    so->so_prev = SWAP_NONE;
+    so->so_next = as->as_swaplist;
+    if (so->so_next != SWAP_NONE)
+        swap_owners[so->so_next].so_prev = blk;
+    as->as_swaplist = blk;
+    spinlock_release(&swap_lock);
+}
+
+struct addrspace *
+swap_clear_owner(swapidx_t blk)
+{
+    KASSERT(blk < swap_nblocks);
+    
+    spinlock_acquire(&swap_lock);
+    struct swap_owner *so = &swap_owners[blk];
+    struct addrspace *as = so->so_as;
+    if (as != NULL) {
+        // take it off AS's list
+        if (so->so_prev != SWAP_NONE)
+            swap_owners[so->so_prev].so_next = so->so_next;
+        else
+            as->as_swaplist = so->so_next;
+        if (so->so_next != SWAP_NONE)
+            swap_owners[so->so_next].so_prev = so->so_prev;
+        so->so_as = NULL;
+    }
+    spinlock_release(&swap_lock);
+    return as;
+}
+
+void
+swap_disown(struct addrspace *as)
+{
+    spinlock_acquire(&swap_lock);
+    swapidx_t blk = as->as_swaplist;
+    while (blk != SWAP_NONE) {
+        struct swap_owner *so = &swap_owners[blk];
+        KASSERT(so->so_as == as);
+        so->so_as = NULL;
+        blk = so->so_next;
+    }
+    as->as_swaplist = SWAP_NONE;
+    spinlock_release(&swap_lock);
+}
+
 void
 swap_wait_lock(void)
 {
@@ -32,6 +32,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <current.h>
+#include <cpu.h>
 #include <thread.h>
 #include <process.h>
 #include <addrspace.h>
@@ -44,23 +45,18 @@ void
 vm_bootstrap(void)
 {
     swap_bootstrap();
-    // Initialize the tlbshootdown pool
-    ts_bootstrap();
     core_cleaner_bootstrap();
+    as_reaper_bootstrap();
 }
 
+/*
+ * Handle a fault on a user address.  *path is set to the VS_FAULT_*
+ * path taken, for the latency histograms.
+ */
+static
 int
-vm_fault(int faulttype, vaddr_t faultaddress)
+vm_user_fault(int faulttype, vaddr_t faultaddress, int *path)
 {
-    // update statistics
-    vs_incr_faults();
-    
-    /* Kernel TLB fault */
-    if (kvm_managed(faultaddress)) {
-        return kvm_fault(faultaddress);
-    }
-    
-    /* User TLB fault */
     struct addrspace *as = curthread->t_proc->ps_addrspace;
     struct page_table *pt = as->as_pgtbl;
     struct pt_entry *pte = pt_acquire_entry(pt, faultaddress);
@@ -94,16 +90,20 @@ vm_fault(int faulttype, vaddr_t faultaddress)
             else {
                 // copy-on-write
                 // NOTE: this will unlock the PTE when it is done
-                return vm_copyonwrite_fault(faultaddress, pt);
+                *path = VS_FAULT_COW;
+                return vm_copyonwrite_fault(faultaddress, as);
             }
     
         case VM_FAULT_READ:
         case VM_FAULT_WRITE:
-            if (pte == NULL)
-                return vm_unmapped_page_fault(faultaddress, pt);
+            if (pte == NULL) {
+                *path = VS_FAULT_ZERO;
+                return vm_unmapped_page_fault(faultaddress, as);
+            }
             else if (!pte_try_access(pte)) { // PTE is in swap
                 // NOTE: this will unlock the PTE when it is done
-                return vm_swapin_page_fault(faultaddress, pte);
+                *path = VS_FAULT_SWAPIN;
+                return vm_swapin_page_fault(faultaddress, pte, as);
             }
             else {
                 // Just load the TLB
@@ -117,14 +117,34 @@ vm_fault(int faulttype, vaddr_t faultaddress)
     }
 }
 
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+    // update statistics
+    vs_incr_faults();
+    
+    /* Kernel TLB fault */
+    if (kvm_managed(faultaddress)) {
+        return kvm_fault(faultaddress);
+    }
+    
+    /* User TLB fault, timed by path */
+    uint32_t start = cpu_cycles();
+    int path = VS_FAULT_TLB;
+    
+    int err = vm_user_fault(faulttype, faultaddress, &path);
+    if (!err)
+        vs_record_fault(path, cpu_cycles() - start);
+    
+    return err;
+}
+
 void
 vm_tlbshootdown_all(void)
 {
     // empty the entire TLB
-    // (this should never occur,
-    // as the per-CPU shootdown queue
-    // is larger than the shootdown pool
-    // from which shootdowns are allocated)
+    // (shootdowns are never batched,
+    // so this does not occur)
     tlb_flush();
 }
 
@@ -150,10 +170,16 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 
 vaddr_t
 alloc_kpages(int npages)
+{
+    return alloc_kpages_flags(npages, 0);
+}
+
+vaddr_t
+alloc_kpages_flags(int npages, int flags)
 {
     if (npages > 1) {
         // get contiguous pages from the kernel VM system
-        return kvm_alloc_contig(npages);
+        return kvm_alloc_contig(npages, flags);
     }
     
     // get a physical page.
@@ -28,6 +28,11 @@
  */
 
 #define VMSTAT_INLINE // <empty>
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <current.h>
 #include <vmstat.h>
 
 // Physical memory statistics
@@ -45,23 +50,185 @@ VS_IMPL(swap_outs);
 // VM system statistics
 VS_IMPL(faults);
 VS_IMPL(cow_faults);
+VS_IMPL(reclaim_waits);
+
+// sizes, fixed at bootstrap
+static size_t vs_ram;
+static size_t vs_swap;
+
+// per-CPU fault latency histograms
+static uint32_t vs_fault_hist[MAXCPUS][VS_NFAULTTYPES][VS_NHISTBUCKETS];
+
+static const char *const vs_fault_names[VS_NFAULTTYPES] = {
+    "TLB reload",
+    "Zero fill",
+    "Swap in",
+    "Copy on write",
+};
+
+// add to the global value directly
+static
+void
+vs_counter_fold(struct vs_counter *vc, int delta)
+{
+    spinlock_acquire(&vc->vc_lock);
+    vc->vc_global += delta;
+    spinlock_release(&vc->vc_lock);
+}
+
+void
+vs_counter_add(struct vs_counter *vc, int delta)
+{
+    // the coremap is in use before the CPU structures exist
+    if (!CURCPU_EXISTS()) {
+        vs_counter_fold(vc, delta);
+        return;
+    }
+    
+    // turn off interrupts to make this atomic w.r.t. this CPU
+    int x = splhigh();
+    
+    unsigned cpu = curcpu->c_number;
+    int d = vc->vc_cpu[cpu] + delta;
+    if (d >= VS_BATCH || d <= -VS_BATCH) {
+        vs_counter_fold(vc, d);
+        d = 0;
+    }
+    vc->vc_cpu[cpu] = d;
+    
+    splx(x);
+}
+
+// Sum of the global value and all the per-CPU slots.
+// No locks: slots may change underneath us, so this is
+// exact only when the counter is quiescent.
+size_t
+vs_counter_sum(struct vs_counter *vc)
+{
+    long sum = vc->vc_global;
+    for (int i = 0; i < MAXCPUS; i++)
+        sum += vc->vc_cpu[i];
+    
+    // slots can be transiently negative
+    return (sum < 0) ? 0 : (size_t)sum;
+}
+
+size_t
+vs_counter_approx(struct vs_counter *vc)
+{
+    long val = vc->vc_global;
+    return (val < 0) ? 0 : (size_t)val;
+}
 
 void
 vs_init_ram(size_t npages, size_t nwired)
 {
-    vs_global.vs_ram = npages;
-    vs_global.vs_ram_free = npages - nwired;
-    vs_global.vs_ram_active = 0;
-    vs_global.vs_ram_inactive = 0;
-    vs_global.vs_ram_wired = nwired;
-    vs_global.vs_ram_dirty = 0;
+    vs_ram = npages;
+    vs_ram_free.vc_global = npages - nwired;
+    vs_ram_active.vc_global = 0;
+    vs_ram_inactive.vc_global = 0;
+    vs_ram_wired.vc_global = nwired;
+    vs_ram_dirty.vc_global = 0;
 }
 
 void
 vs_init_swap(size_t nblocks)
 {
-    vs_global.vs_swap = nblocks;
-    vs_global.vs_swap_free = nblocks;
-    vs_global.vs_swap_ins = 0;
-    vs_global.vs_swap_outs = 0;
+    vs_swap = nblocks;
+    vs_swap_free.vc_global = nblocks;
+    vs_swap_ins.vc_global = 0;
+    vs_swap_outs.vc_global = 0;
+}
+
+// index of the highest set bit, capped to the last bucket
+static
+int
+vs_bucket(uint32_t ncycles)
+{
+    int b = 0;
+    while (ncycles >>= 1)
+        b++;
+    return (b < VS_NHISTBUCKETS) ? b : VS_NHISTBUCKETS - 1;
+}
+
+void
+vs_record_fault(int type, uint32_t ncycles)
+{
+    KASSERT(type >= 0 && type < VS_NFAULTTYPES);
+    
+    if (!CURCPU_EXISTS())
+        return;
+    
+    // turn off interrupts to make this atomic w.r.t. this CPU
+    int x = splhigh();
+    vs_fault_hist[curcpu->c_number][type][vs_bucket(ncycles)]++;
+    splx(x);
+}
+
+void
+vs_snapshot(struct vmstat *vs)
+{
+    vs->vs_ram = vs_ram;
+    vs->vs_ram_free = vs_get_ram_free();
+    vs->vs_ram_active = vs_get_ram_active();
+    vs->vs_ram_inactive = vs_get_ram_inactive();
+    vs->vs_ram_wired = vs_get_ram_wired();
+    vs->vs_ram_dirty = vs_get_ram_dirty();
+    
+    vs->vs_swap = vs_swap;
+    vs->vs_swap_free = vs_get_swap_free();
+    vs->vs_swap_ins = vs_get_swap_ins();
+    vs->vs_swap_outs = vs_get_swap_outs();
+    
+    vs->vs_faults = vs_get_faults();
+    vs->vs_cow_faults = vs_get_cow_faults();
+    vs->vs_reclaim_waits = vs_get_reclaim_waits();
+    
+    // sum the histograms over all CPUs
+    for (int t = 0; t < VS_NFAULTTYPES; t++) {
+        for (int b = 0; b < VS_NHISTBUCKETS; b++) {
+            size_t count = 0;
+            for (int i = 0; i < MAXCPUS; i++)
+                count += vs_fault_hist[i][t][b];
+            vs->vs_fault_hist[t][b] = count;
+        }
+    }
+}
+
+void
+vs_print_faults(void)
+{
+    struct vmstat vs;
+    vs_snapshot(&vs);
+    
+    kprintf("Fault latency (cycles):\n");
+    for (int t = 0; t < VS_NFAULTTYPES; t++) {
+        size_t total = 0;
+        for (int b = 0; b < VS_NHISTBUCKETS; b++)
+            total += vs.vs_fault_hist[t][b];
+        
+        kprintf("%s: %lu faults\n", vs_fault_names[t],
+                (unsigned long)total);
+        if (total == 0)
+            continue;
+        
+        // print each nonempty bucket with its running percentile
+        size_t sofar = 0;
+        for (int b = 0; b < VS_NHISTBUCKETS; b++) {
+            size_t count = vs.vs_fault_hist[t][b];
+            if (count == 0)
+                continue;
+            sofar += count;
+            
+            if (b == VS_NHISTBUCKETS - 1)
+                kprintf("    >= %-10lu        %8lu  (%3lu%%)\n",
+                        1UL << b, (unsigned long)count,
+                        (unsigned long)(sofar * 100 / total));
+            else
+                kprintf("    %10lu - %-10lu %8lu  (%3lu%%)\n",
+                        1UL << b, (1UL << (b + 1)) - 1,
+                        (unsigned long)count,
+                        (unsigned long)(sofar * 100 / total));
+        }
+    }
 }